@@ -0,0 +1,338 @@
+#pragma once
+#include "Matrix.h"
+#include "MpmcQueue.h"
+#include "Futex.h"
+#include <pthread.h>
+#include <sched.h>
+#include <chrono>
+#include <functional>
+
+// 动态批处理调度器
+// 各连接并发提交的单行请求放进有界无锁队列,由一组推理线程取走,每批最多maxBatch行,
+// 整批做一次前向计算(权重只从内存读一遍,多次GEMV变成一次GEMM),最后把每行结果交回各自的请求.
+// 同一时刻只有一个推理线程在凑批次(收集者),其余空闲线程等它交出收集权,所以并发到达的请求不会被拆成很多小批次.
+// 收集者取到第一行时队列里没有别的请求就立即计算,低负载时不增加延迟; 队列里还有请求说明负载高,
+// 才继续凑到满批或者最早的请求已经等了maxWait.
+// 请求的输入放在预先分配的槽里,队列中只传递槽号: free_是空闲槽,ready_是已写好输入等待计算的槽.
+// 每个推理线程有自己的批次缓冲区和推理会话,绑定在各自的CPU上.
+class Batcher
+{
+public:
+    // 结果回调: output为output_size()个概率,出错时为nullptr; 在推理线程上调用,不能阻塞太久
+    using Callback = std::function<void(const float *output, size_t n)>;
+    // 每个批次开始时调用一次,取当前模型(模型可以在运行中被替换)
+    using ModelSource = std::function<std::shared_ptr<const modelbase>()>;
+
+    // workers为推理线程数,0表示每个CPU一个
+    Batcher(ModelSource source, size_t maxBatch = 32, std::chrono::microseconds maxWait = std::chrono::microseconds(200),
+            size_t workers = 1);
+    ~Batcher();
+
+    // 提交一行输入,n必须等于模型的input_size(); input在返回前已拷贝,调用者可以立即复用
+    // 可以在任意线程并发调用; 所有槽都在使用中时阻塞,直到推理线程取走一批(事件循环这样的线程用try_submit)
+    void submit(const float *input, size_t n, Callback done);
+    // 提交一行0~255的像素,拷进槽的同时除以255,不需要先转换成float
+    void submit(const uint8_t *pixels, size_t n, Callback done);
+    // 不阻塞的提交: 没有空闲槽时返回false,done不会被调用; 之后第一次有槽归还时调用set_on_free设置的回调
+    bool try_submit(const float *input, size_t n, Callback done);
+    bool try_submit(const uint8_t *pixels, size_t n, Callback done);
+    // try_submit失败后有槽归还时调用,在推理线程上执行,不能阻塞; 要在第一次提交之前设置
+    void set_on_free(std::function<void()> onFree) { onFree_ = std::move(onFree); }
+
+    size_t max_batch() const { return maxBatch_; }
+    size_t workers() const { return workers_; }
+
+    Batcher(const Batcher &) = delete;
+    Batcher &operator=(const Batcher &) = delete;
+
+private:
+    // 占一个空闲槽,fill(row)写入这一行的输入,再放进ready_
+    // block为false时没有空闲槽就返回false,不调用done
+    template <typename Fill>
+    bool enqueue(size_t n, Fill fill, Callback &done, bool block);
+    void run();
+    // 凑一个批次,槽号写入slots,返回行数; 停止时返回0
+    size_t collect(uint32_t *slots);
+    // 在seq上等到它不再等于expected(或超时),sleepers记录等待者,提交方只在有人等待时才进入内核唤醒
+    void sleep(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &sleepers, uint32_t expected,
+               const struct timespec *timeout = nullptr);
+    void wake(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &sleepers, int count);
+
+    ModelSource source_;
+    size_t maxBatch_;
+    std::chrono::microseconds maxWait_;
+    size_t inputSize_;
+    size_t workers_;
+
+    Matrix<float> rows_;                                          // 每个槽一行输入
+    std::vector<Callback> callbacks_;                             // 每个槽的回调
+    std::vector<std::chrono::steady_clock::time_point> arrived_; // 每个槽的提交时间
+    MpmcQueue<uint32_t> free_;
+    MpmcQueue<uint32_t> ready_;
+
+    std::atomic<uint32_t> readySeq_{0};   // 每放进ready_一个槽加1,收集者在上面等待
+    std::atomic<uint32_t> readySleepers_{0};
+    std::atomic<bool> collecting_{false}; // 有推理线程正在凑批次
+    std::atomic<uint32_t> idleSeq_{0};    // 每交出一次收集权加1,其余空闲的推理线程在上面等待
+    std::atomic<uint32_t> idleSleepers_{0};
+    std::atomic<uint32_t> freeSeq_{0};    // 每归还一批槽加1,没有空闲槽的提交方在上面等待
+    std::atomic<uint32_t> freeSleepers_{0};
+    std::atomic<bool> wantFree_{false}; // 有try_submit因为没有空闲槽失败,归还槽时要调用onFree_
+    std::function<void()> onFree_;
+    std::atomic<bool> stop_{false};
+    std::vector<std::thread> threads_;
+};
+
+inline Batcher::Batcher(ModelSource source, size_t maxBatch, std::chrono::microseconds maxWait, size_t workers)
+    : source_(std::move(source)), maxBatch_(std::max<size_t>(1, maxBatch)), maxWait_(maxWait),
+      inputSize_(source_()->input_size()),
+      workers_(workers ? workers : std::max(1u, std::thread::hardware_concurrency())), rows_(0, 0),
+      free_(4 * maxBatch_ * workers_), ready_(free_.capacity()) // 每个推理线程计算一批时,还能再凑几批
+{
+    size_t slots = free_.capacity();
+    rows_ = Matrix<float>(slots, inputSize_);
+    callbacks_.resize(slots);
+    arrived_.resize(slots);
+    for (uint32_t i = 0; i < slots; ++i)
+        free_.try_push(i);
+
+    // 进程允许使用的CPU,推理线程依次绑定到上面
+    cpu_set_t allowed;
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &allowed))
+                cpus.push_back(c);
+    for (size_t w = 0; w < workers_; ++w)
+    {
+        threads_.emplace_back([this]()
+                              { run(); });
+        if (cpus.size() > 1)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[w % cpus.size()], &set);
+            pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set);
+        }
+    }
+}
+
+inline Batcher::~Batcher()
+{
+    stop_ = true;
+    readySeq_.fetch_add(1);
+    futex_wake(readySeq_);
+    idleSeq_.fetch_add(1);
+    futex_wake(idleSeq_);
+    freeSeq_.fetch_add(1);
+    futex_wake(freeSeq_);
+    for (std::thread &t : threads_)
+        t.join();
+}
+
+inline void Batcher::sleep(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &sleepers, uint32_t expected,
+                           const struct timespec *timeout)
+{
+    futex_wait(seq, expected, timeout);
+    sleepers.fetch_sub(1);
+}
+
+inline void Batcher::wake(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &sleepers, int count)
+{
+    // 先改seq再读sleepers: 等待方先登记再读seq,两边至少有一方看到对方,不会丢失唤醒
+    seq.fetch_add(1);
+    if (sleepers.load() > 0)
+        futex_wake(seq, count);
+}
+
+inline void Batcher::submit(const float *input, size_t n, Callback done)
+{
+    enqueue(n, [input, n](float *row)
+            { std::memcpy(row, input, n * sizeof(float)); },
+            done, true);
+}
+
+inline void Batcher::submit(const uint8_t *pixels, size_t n, Callback done)
+{
+    enqueue(n, [pixels, n](float *row)
+            { u8_to_float(pixels, row, n, 1.0f / 255.0f); },
+            done, true);
+}
+
+inline bool Batcher::try_submit(const float *input, size_t n, Callback done)
+{
+    return enqueue(n, [input, n](float *row)
+                   { std::memcpy(row, input, n * sizeof(float)); },
+                   done, false);
+}
+
+inline bool Batcher::try_submit(const uint8_t *pixels, size_t n, Callback done)
+{
+    return enqueue(n, [pixels, n](float *row)
+                   { u8_to_float(pixels, row, n, 1.0f / 255.0f); },
+                   done, false);
+}
+
+template <typename Fill>
+bool Batcher::enqueue(size_t n, Fill fill, Callback &done, bool block)
+{
+    if (n != inputSize_)
+        throw std::invalid_argument("Input dimension must be " + std::to_string(inputSize_));
+    if (stop_)
+    {
+        done(nullptr, 0);
+        return true;
+    }
+    uint32_t slot;
+    while (!free_.try_pop(slot))
+    {
+        if (!block)
+        {
+            // 先登记再重试一次: 推理线程先归还槽再检查wantFree_,两边至少有一方看到对方
+            wantFree_.store(true);
+            if (free_.try_pop(slot))
+                break;
+            return false;
+        }
+        freeSleepers_.fetch_add(1);
+        uint32_t seq = freeSeq_.load();
+        if (stop_ || free_.try_pop(slot))
+        {
+            freeSleepers_.fetch_sub(1);
+            if (stop_)
+            {
+                done(nullptr, 0);
+                return true;
+            }
+            break;
+        }
+        sleep(freeSeq_, freeSleepers_, seq);
+    }
+    fill(rows_.row(slot));
+    callbacks_[slot] = std::move(done);
+    arrived_[slot] = std::chrono::steady_clock::now();
+    ready_.try_push(slot); // 槽的总数等于队列容量,不会满
+    wake(readySeq_, readySleepers_, 1);
+    return true;
+}
+
+inline size_t Batcher::collect(uint32_t *slots)
+{
+    // 取第一行,队列空时睡眠
+    while (!ready_.try_pop(slots[0]))
+    {
+        readySleepers_.fetch_add(1);
+        uint32_t seq = readySeq_.load();
+        if (ready_.try_pop(slots[0]))
+        {
+            readySleepers_.fetch_sub(1);
+            break;
+        }
+        if (stop_)
+        {
+            readySleepers_.fetch_sub(1);
+            return 0;
+        }
+        sleep(readySeq_, readySleepers_, seq);
+    }
+
+    // 把已经在排队的都取走; 只有第一行时不等,直接计算
+    size_t n = 1;
+    while (n < maxBatch_ && ready_.try_pop(slots[n]))
+        ++n;
+    if (n == 1)
+        return n;
+
+    // 负载高: 继续凑批次,直到凑满或者最早的请求等够maxWait
+    auto deadline = arrived_[slots[0]] + maxWait_;
+    while (n < maxBatch_)
+    {
+        if (ready_.try_pop(slots[n]))
+        {
+            ++n;
+            continue;
+        }
+        auto left = deadline - std::chrono::steady_clock::now();
+        if (left <= std::chrono::nanoseconds(0) || stop_)
+            break;
+        readySleepers_.fetch_add(1);
+        uint32_t seq = readySeq_.load();
+        if (ready_.try_pop(slots[n]))
+        {
+            readySleepers_.fetch_sub(1);
+            ++n;
+            continue;
+        }
+        struct timespec ts;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        sleep(readySeq_, readySleepers_, seq, &ts);
+    }
+    return n;
+}
+
+inline void Batcher::run()
+{
+    // 推理线程自己的批次: 输入从槽里拷过来,槽立即归还,计算期间提交方可以继续使用
+    Matrix<float> batch(maxBatch_, inputSize_);
+    std::vector<Callback> callbacks(maxBatch_);
+    std::vector<uint32_t> slots(maxBatch_);
+    std::shared_ptr<const modelbase> sessionModel;
+    std::unique_ptr<InferenceSessionBase> session;
+
+    while (true)
+    {
+        // 取得收集权,已经有别的推理线程在凑批次时等它交出来
+        while (collecting_.exchange(true))
+        {
+            idleSleepers_.fetch_add(1);
+            uint32_t seq = idleSeq_.load();
+            if (stop_ || !collecting_.load())
+            {
+                idleSleepers_.fetch_sub(1);
+                if (stop_)
+                    return;
+                continue;
+            }
+            sleep(idleSeq_, idleSleepers_, seq);
+        }
+        size_t n = collect(slots.data());
+        collecting_.store(false);
+        wake(idleSeq_, idleSleepers_, 1); // 下一个空闲的推理线程接着收集
+        if (n == 0)
+            return;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            std::memcpy(batch.row(i), rows_.row(slots[i]), inputSize_ * sizeof(float));
+            callbacks[i] = std::move(callbacks_[slots[i]]);
+            free_.try_push(slots[i]);
+        }
+        wake(freeSeq_, freeSleepers_, INT_MAX);
+        if (wantFree_.load() && wantFree_.exchange(false) && onFree_)
+            onFree_();
+
+        const Matrix<float> *output = nullptr;
+        try
+        {
+            std::shared_ptr<const modelbase> m = source_();
+            if (m != sessionModel) // 模型被重新加载过,换一个新会话
+            {
+                session.reset();
+                session = m->make_session(maxBatch_);
+                sessionModel = m;
+            }
+            output = &session->forward(Matrix<float>::view(batch.data(), n, inputSize_, batch.stride()));
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "Batch inference failed: %s\n", e.what());
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            callbacks[i](output ? output->row(i) : nullptr, output ? output->cols() : 0);
+            callbacks[i] = nullptr;
+        }
+    }
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include "Protocol.h"
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 推理服务的客户端: 一个长连接反复使用,第一次请求时才连接,连接断开后下次请求自动重连
+// send_request只发不收,可以连续发出多个请求(流水线),再用wait按id取结果; 一个请求可以带多行输入
+// unixPath不为空时优先连接这个AF_UNIX套接字(同一台机器上不经过TCP协议栈),连不上再用TCP
+// 服务端超过RECV_TIMEOUT_MS没有响应时当作连接失效,断开后返回失败,不会一直阻塞调用线程
+// 不是线程安全的,每个线程用自己的客户端
+class InferenceClient
+{
+public:
+    InferenceClient(const std::string &ip, int port, const std::string &unixPath = "")
+        : ip_(ip), port_(port), unixPath_(unixPath) {}
+    ~InferenceClient() { disconnect(); }
+
+    // 发送一个batch行的请求(每行INPUT_FLOATS个float,按行连续存放),不等待结果; 返回请求id,失败返回0
+    uint32_t send_request(const float *inputs, size_t batch = 1);
+    // 同上,输入为0~255的像素(每行INPUT_FLOATS字节),由服务端归一化,传输量只有float的1/4
+    uint32_t send_request(const uint8_t *pixels, size_t batch = 1);
+    // 等到id的结果写入outputs(batch行,每行OUTPUT_FLOATS个float); 先到的其他请求的结果暂存起来
+    bool wait(uint32_t id, float *outputs);
+    // 同步预测一行,连接已失效(例如服务端重启)时重连后重试一次; 服务端明确报告的失败不重试
+    bool predict(const float *input, float *output);
+    bool predict(const uint8_t *pixels, float *output);
+    // 批量预测: n行输入放在一个请求里发送,inputs和outputs都按行连续存放
+    bool predict_many(const float *inputs, size_t n, float *outputs);
+
+    InferenceClient(const InferenceClient &) = delete;
+    InferenceClient &operator=(const InferenceClient &) = delete;
+
+private:
+    enum WaitResult
+    {
+        WAIT_OK,
+        WAIT_FAILED, // 服务端返回了失败状态,连接仍然可用
+        WAIT_BROKEN, // 收发出错,对端关闭或响应格式不对,连接已断开
+    };
+
+    WaitResult wait_result(uint32_t id, float *outputs);
+    uint32_t send_frame(uint8_t dtype, const void *payload, size_t batch);
+    template <typename In>
+    bool predict_retry(const In *input, float *output);
+    bool connect_server();
+    void set_recv_timeout();
+    void disconnect();
+    bool send_all(const void *data, size_t len);
+    bool recv_all(void *data, size_t len);
+
+    bool connect_unix();
+
+    static constexpr int RECV_TIMEOUT_MS = 2000; // 与共享内存通道的超时相同
+
+    std::string ip_;
+    int port_;
+    std::string unixPath_;
+    int fd_ = -1;
+    uint32_t nextId_ = 1;
+    std::unordered_map<uint32_t, std::vector<float>> ready_; // 已收到但还没被wait取走的结果
+    std::unordered_set<uint32_t> failed_;                    // 服务端报告失败的请求
+};
+
+inline bool InferenceClient::connect_unix()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (unixPath_.size() >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, unixPath_.c_str());
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ == -1)
+        return false;
+    if (connect(fd_, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    printf("Connected to server %s\n", unixPath_.c_str());
+    return true;
+}
+
+inline bool InferenceClient::connect_server()
+{
+    if (fd_ != -1)
+        return true;
+    if (!unixPath_.empty() && connect_unix())
+    {
+        set_recv_timeout();
+        return true;
+    }
+    struct sockaddr_in serverAddr; // 服务器地址结构
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port_);
+    if (inet_pton(AF_INET, ip_.c_str(), &(serverAddr.sin_addr)) <= 0)
+    {
+        perror("Failed to set server IP");
+        return false;
+    }
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ == -1)
+    {
+        perror("Failed to create socket");
+        return false;
+    }
+    if (connect(fd_, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == -1)
+    {
+        perror("Failed to connect to server");
+        disconnect();
+        return false;
+    }
+    // 小请求不等Nagle合并,立即发出
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_recv_timeout();
+    printf("Connected to server %s:%d\n", ip_.c_str(), port_);
+    return true;
+}
+
+inline void InferenceClient::set_recv_timeout()
+{
+    struct timeval tv;
+    tv.tv_sec = RECV_TIMEOUT_MS / 1000;
+    tv.tv_usec = RECV_TIMEOUT_MS % 1000 * 1000;
+    if (setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+        perror("Failed to set receive timeout");
+}
+
+inline void InferenceClient::disconnect()
+{
+    if (fd_ != -1)
+        close(fd_);
+    fd_ = -1;
+    ready_.clear(); // 旧连接上未完成的请求不会再有响应
+    failed_.clear();
+}
+
+inline bool InferenceClient::send_all(const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+    while (len > 0)
+    {
+        ssize_t w = send(fd_, p, len, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+        {
+            perror("Failed to send data");
+            return false;
+        }
+        p += w;
+        len -= w;
+    }
+    return true;
+}
+
+inline bool InferenceClient::recv_all(void *data, size_t len)
+{
+    char *p = static_cast<char *>(data);
+    while (len > 0)
+    {
+        ssize_t r = recv(fd_, p, len, 0);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            // 超时的连接上可能还有半个响应,调用者断开后不能再用
+            if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                fprintf(stderr, "Timed out waiting for server\n");
+            else if (r == -1)
+                perror("Failed to receive data");
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+inline uint32_t InferenceClient::send_frame(uint8_t dtype, const void *payload, size_t batch)
+{
+    size_t length = batch * INPUT_FLOATS * payload_element_size(dtype);
+    if (batch == 0 || length > PROTOCOL_MAX_PAYLOAD)
+        return 0;
+    if (!connect_server())
+        return 0;
+    if (nextId_ == 0) // 0表示失败,跳过
+        ++nextId_;
+    RequestHeader header{PROTOCOL_MAGIC, PROTOCOL_VERSION, dtype, 0, nextId_, (uint32_t)batch, (uint32_t)length};
+    if (!send_all(&header, sizeof(header)) || !send_all(payload, length))
+    {
+        disconnect();
+        return 0;
+    }
+    return nextId_++;
+}
+
+inline uint32_t InferenceClient::send_request(const float *inputs, size_t batch)
+{
+    return send_frame(PAYLOAD_FP32, inputs, batch);
+}
+
+inline uint32_t InferenceClient::send_request(const uint8_t *pixels, size_t batch)
+{
+    return send_frame(PAYLOAD_U8, pixels, batch);
+}
+
+inline bool InferenceClient::wait(uint32_t id, float *outputs)
+{
+    return wait_result(id, outputs) == WAIT_OK;
+}
+
+inline InferenceClient::WaitResult InferenceClient::wait_result(uint32_t id, float *outputs)
+{
+    while (true)
+    {
+        auto it = ready_.find(id);
+        if (it != ready_.end())
+        {
+            memcpy(outputs, it->second.data(), it->second.size() * sizeof(float));
+            ready_.erase(it);
+            return WAIT_OK;
+        }
+        if (failed_.erase(id))
+            return WAIT_FAILED;
+        if (fd_ == -1)
+            return WAIT_BROKEN;
+
+        ResponseHeader header;
+        if (!recv_all(&header, sizeof(header)))
+        {
+            disconnect();
+            return WAIT_BROKEN;
+        }
+        if (header.magic != PROTOCOL_MAGIC || header.version != PROTOCOL_VERSION ||
+            header.length > PROTOCOL_MAX_PAYLOAD || header.length % sizeof(float) != 0 ||
+            (header.status == STATUS_OK && header.length != (size_t)header.batch * OUTPUT_FLOATS * sizeof(float)))
+        {
+            fprintf(stderr, "Invalid response from server\n");
+            disconnect();
+            return WAIT_BROKEN;
+        }
+        std::vector<float> result(header.length / sizeof(float));
+        if (!recv_all(result.data(), header.length))
+        {
+            disconnect();
+            return WAIT_BROKEN;
+        }
+        if (header.status != STATUS_OK)
+            failed_.insert(header.id);
+        else
+            ready_[header.id] = std::move(result);
+    }
+}
+
+template <typename In>
+bool InferenceClient::predict_retry(const In *input, float *output)
+{
+    // 只有连接出错才重连重试; 服务端返回的失败状态原样交给调用者,连接和其他请求已经收到的结果都保留
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        uint32_t id = send_request(input);
+        if (id == 0) // 连接或发送失败,send_frame已经断开
+            continue;
+        WaitResult r = wait_result(id, output);
+        if (r != WAIT_BROKEN)
+            return r == WAIT_OK;
+    }
+    return false;
+}
+
+inline bool InferenceClient::predict(const float *input, float *output)
+{
+    return predict_retry(input, output);
+}
+
+inline bool InferenceClient::predict(const uint8_t *pixels, float *output)
+{
+    return predict_retry(pixels, output);
+}
+
+inline bool InferenceClient::predict_many(const float *inputs, size_t n, float *outputs)
+{
+    uint32_t id = send_request(inputs, n);
+    return id != 0 && wait(id, outputs);
+}
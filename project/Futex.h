@@ -0,0 +1,21 @@
+#pragma once
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+// futex等待/唤醒,不带FUTEX_PRIVATE_FLAG,所以也能用在进程间共享的内存上
+// word的值不等于expected时立即返回; timeout为相对时间,nullptr表示一直等
+inline void futex_wait(std::atomic<uint32_t> &word, uint32_t expected, const struct timespec *timeout = nullptr)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+// 唤醒最多count个在word上等待的线程
+inline void futex_wake(std::atomic<uint32_t> &word, int count = INT_MAX)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
@@ -0,0 +1,895 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <vector>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// SIMD计算内核
+// 指令集在编译期选择: 有AVX-512用AVX-512,否则有AVX2+FMA用AVX2,都没有则退化为标量.
+
+// 向量寄存器的统一封装,width为一个寄存器能放下的元素个数
+template <typename T>
+struct Simd
+{
+    using reg = T;
+    static constexpr size_t width = 1;
+    static reg zero() { return static_cast<T>(0); }
+    static reg set1(T v) { return v; }
+    static reg load(const T *p) { return *p; }
+    static void store(T *p, reg v) { *p = v; }
+    static reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+    static reg add(reg a, reg b) { return a + b; }
+    static reg sub(reg a, reg b) { return a - b; }
+    static reg mul(reg a, reg b) { return a * b; }
+    static reg max(reg a, reg b) { return a > b ? a : b; }
+    static T reduce_add(reg a) { return a; }
+    static T reduce_max(reg a) { return a; }
+    static reg exp(reg a) { return std::exp(a); }
+};
+
+// float的exp近似(Cephes expf): e^x = 2^n * e^r, |r| <= ln2/2, e^r用5阶多项式,相对误差约1e-7
+// 要求V提供min/max/round和pow2(把整数值n变成2^n)
+#define SIMD_EXPF_BODY(V, x)                                              \
+    x = V::min(V::max(x, V::set1(-87.3f)), V::set1(88.3f));               \
+    reg fx = V::round(V::mul(x, V::set1(1.44269504088896341f)));           \
+    x = V::fmadd(fx, V::set1(-0.693359375f), x);                          \
+    x = V::fmadd(fx, V::set1(2.12194440e-4f), x);                         \
+    reg y = V::set1(1.9875691500e-4f);                                    \
+    y = V::fmadd(y, x, V::set1(1.3981999507e-3f));                        \
+    y = V::fmadd(y, x, V::set1(8.3334519073e-3f));                        \
+    y = V::fmadd(y, x, V::set1(4.1665795894e-2f));                        \
+    y = V::fmadd(y, x, V::set1(1.6666665459e-1f));                        \
+    y = V::fmadd(y, x, V::set1(5.0000001201e-1f));                        \
+    y = V::fmadd(y, V::mul(x, x), V::add(x, V::set1(1.0f)));              \
+    return V::mul(y, V::pow2(fx));
+
+#if defined(__AVX512F__)
+template <>
+struct Simd<float>
+{
+    using reg = __m512;
+    static constexpr size_t width = 16;
+    static reg zero() { return _mm512_setzero_ps(); }
+    static reg set1(float v) { return _mm512_set1_ps(v); }
+    static reg load(const float *p) { return _mm512_loadu_ps(p); }
+    static void store(float *p, reg v) { _mm512_storeu_ps(p, v); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+    static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+    static reg max(reg a, reg b) { return _mm512_max_ps(a, b); }
+    static reg min(reg a, reg b) { return _mm512_min_ps(a, b); }
+    static float reduce_add(reg a) { return _mm512_reduce_add_ps(a); }
+    static float reduce_max(reg a) { return _mm512_reduce_max_ps(a); }
+    static reg round(reg a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+    static reg pow2(reg n) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23)); }
+    static reg exp(reg x) { SIMD_EXPF_BODY(Simd, x) }
+};
+
+template <>
+struct Simd<double>
+{
+    using reg = __m512d;
+    static constexpr size_t width = 8;
+    static reg zero() { return _mm512_setzero_pd(); }
+    static reg set1(double v) { return _mm512_set1_pd(v); }
+    static reg load(const double *p) { return _mm512_loadu_pd(p); }
+    static void store(double *p, reg v) { _mm512_storeu_pd(p, v); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a, b, c); }
+    static reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm512_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+    static reg max(reg a, reg b) { return _mm512_max_pd(a, b); }
+    static double reduce_add(reg a) { return _mm512_reduce_add_pd(a); }
+    static double reduce_max(reg a) { return _mm512_reduce_max_pd(a); }
+    // double保持精度,逐个元素调用std::exp
+    static reg exp(reg a)
+    {
+        alignas(64) double v[width];
+        _mm512_store_pd(v, a);
+        for (double &e : v)
+            e = std::exp(e);
+        return _mm512_load_pd(v);
+    }
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+template <>
+struct Simd<float>
+{
+    using reg = __m256;
+    static constexpr size_t width = 8;
+    static reg zero() { return _mm256_setzero_ps(); }
+    static reg set1(float v) { return _mm256_set1_ps(v); }
+    static reg load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, reg v) { _mm256_storeu_ps(p, v); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_ps(a, b, c); }
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+    static reg max(reg a, reg b) { return _mm256_max_ps(a, b); }
+    static reg min(reg a, reg b) { return _mm256_min_ps(a, b); }
+    static float reduce_add(reg a)
+    {
+        __m128 v = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        v = _mm_add_ss(v, _mm_movehdup_ps(v));
+        return _mm_cvtss_f32(v);
+    }
+    static float reduce_max(reg a)
+    {
+        __m128 v = _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+        v = _mm_max_ss(v, _mm_movehdup_ps(v));
+        return _mm_cvtss_f32(v);
+    }
+    static reg round(reg a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+    static reg pow2(reg n) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23)); }
+    static reg exp(reg x) { SIMD_EXPF_BODY(Simd, x) }
+};
+
+template <>
+struct Simd<double>
+{
+    using reg = __m256d;
+    static constexpr size_t width = 4;
+    static reg zero() { return _mm256_setzero_pd(); }
+    static reg set1(double v) { return _mm256_set1_pd(v); }
+    static reg load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, reg v) { _mm256_storeu_pd(p, v); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_pd(a, b, c); }
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+    static reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+    static double reduce_add(reg a)
+    {
+        __m128d v = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+    }
+    static double reduce_max(reg a)
+    {
+        __m128d v = _mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+        return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+    }
+    // double保持精度,逐个元素调用std::exp
+    static reg exp(reg a)
+    {
+        alignas(32) double v[width];
+        _mm256_store_pd(v, a);
+        for (double &e : v)
+            e = std::exp(e);
+        return _mm256_load_pd(v);
+    }
+};
+#endif
+#undef SIMD_EXPF_BODY
+
+// 16位浮点权重的存储格式,只用于存放权重,计算时在寄存器里展开成float,累加仍是fp32
+// fp16: IEEE半精度,1位符号+5位指数+10位尾数
+// bf16: float的高16位,指数范围与float相同,尾数只有7位
+struct fp16_t
+{
+    uint16_t bits = 0;
+
+    fp16_t() = default;
+    // float转fp16,就近舍入到偶数,超出范围变成无穷大
+    explicit fp16_t(float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, 4);
+        uint32_t sign = (x >> 16) & 0x8000u, absx = x & 0x7fffffffu;
+        if (absx >= 0x7f800000u) // inf/nan
+            bits = static_cast<uint16_t>(sign | 0x7c00u | (absx > 0x7f800000u ? 0x200u : 0u));
+        else if (absx >= 0x477ff000u) // 舍入后超过65504
+            bits = static_cast<uint16_t>(sign | 0x7c00u);
+        else if (absx < 0x38800000u) // fp16的非规格化数
+        {
+            if (absx < 0x33000000u)
+                bits = static_cast<uint16_t>(sign);
+            else
+            {
+                uint32_t shift = 126 - (absx >> 23), mant = (absx & 0x7fffffu) | 0x800000u;
+                uint32_t h = mant >> shift, rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+                h += rem > half || (rem == half && (h & 1));
+                bits = static_cast<uint16_t>(sign | h);
+            }
+        }
+        else
+        {
+            uint32_t h = ((absx - 0x38000000u) >> 13), rem = absx & 0x1fffu;
+            h += rem > 0x1000u || (rem == 0x1000u && (h & 1));
+            bits = static_cast<uint16_t>(sign | h);
+        }
+    }
+    explicit operator float() const
+    {
+        uint32_t sign = static_cast<uint32_t>(bits & 0x8000u) << 16, exp = (bits >> 10) & 0x1f, mant = bits & 0x3ffu, x;
+        if (exp == 0x1f)
+            x = sign | 0x7f800000u | (mant << 13);
+        else if (exp != 0)
+            x = sign | ((exp + 112) << 23) | (mant << 13);
+        else if (mant == 0)
+            x = sign;
+        else
+        {
+            // 非规格化数: 规格化尾数
+            exp = 113;
+            while (!(mant & 0x400u))
+            {
+                mant <<= 1;
+                --exp;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+        }
+        float f;
+        std::memcpy(&f, &x, 4);
+        return f;
+    }
+};
+
+struct bf16_t
+{
+    uint16_t bits = 0;
+
+    bf16_t() = default;
+    // float转bf16,就近舍入到偶数,nan保持为nan
+    explicit bf16_t(float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, 4);
+        if ((x & 0x7fffffffu) > 0x7f800000u)
+            bits = static_cast<uint16_t>((x >> 16) | 0x40u);
+        else
+            bits = static_cast<uint16_t>((x + 0x7fffu + ((x >> 16) & 1)) >> 16);
+    }
+    explicit operator float() const
+    {
+        uint32_t x = static_cast<uint32_t>(bits) << 16;
+        float f;
+        std::memcpy(&f, &x, 4);
+        return f;
+    }
+};
+
+// 从存储类型S的数组读一个寄存器宽度的元素,展开成计算类型T
+// S与T相同时就是普通的load;没有对应转换指令时逐个转换到栈上再load
+template <typename T, typename S>
+struct WidenLoad
+{
+    static typename Simd<T>::reg load(const S *p)
+    {
+        if constexpr (std::is_same_v<T, S>)
+            return Simd<T>::load(p);
+        else
+        {
+            T tmp[Simd<T>::width];
+            for (size_t i = 0; i < Simd<T>::width; ++i)
+                tmp[i] = static_cast<T>(p[i]);
+            return Simd<T>::load(tmp);
+        }
+    }
+};
+
+#if defined(__AVX512F__)
+template <>
+struct WidenLoad<float, fp16_t>
+{
+    static __m512 load(const fp16_t *p) { return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))); }
+};
+
+template <>
+struct WidenLoad<float, bf16_t>
+{
+    static __m512 load(const bf16_t *p)
+    {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+        return _mm512_castsi512_ps(_mm512_slli_epi32(v, 16));
+    }
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+#if defined(__F16C__)
+template <>
+struct WidenLoad<float, fp16_t>
+{
+    static __m256 load(const fp16_t *p) { return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))); }
+};
+#endif
+
+template <>
+struct WidenLoad<float, bf16_t>
+{
+    static __m256 load(const bf16_t *p)
+    {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(v, 16));
+    }
+};
+#endif
+
+// 向量乘矩阵: y[0:n] = x[0:k] * W[0:k, 0:n], W行优先,相邻两行相距ldw个元素
+// 输出按4个寄存器一块常驻寄存器,沿k逐行连续读W,整块算完才写回y
+// bias不为空时累加器从bias开始,relu为true时写回前截断负数,即一遍完成线性层+偏置+ReLU
+// W可以是fp16_t/bf16_t存储,读入寄存器时展开成T再计算
+template <typename T, typename TW = T>
+void gemv(const T *x, const TW *W, size_t ldw, T *y, size_t k, size_t n, const T *bias = nullptr, bool relu = false)
+{
+    using V = Simd<T>;
+    using L = WidenLoad<T, TW>;
+    constexpr size_t w = V::width;
+    auto init = [bias](size_t j)
+    { return bias ? V::load(bias + j) : V::zero(); };
+    auto finish = [relu](typename V::reg v)
+    { return relu ? V::max(v, V::zero()) : v; };
+    size_t j = 0;
+    for (; j + 4 * w <= n; j += 4 * w)
+    {
+        typename V::reg acc0 = init(j), acc1 = init(j + w), acc2 = init(j + 2 * w), acc3 = init(j + 3 * w);
+        const TW *wp = W + j;
+        for (size_t p = 0; p < k; ++p, wp += ldw)
+        {
+            typename V::reg xp = V::set1(x[p]);
+            acc0 = V::fmadd(xp, L::load(wp), acc0);
+            acc1 = V::fmadd(xp, L::load(wp + w), acc1);
+            acc2 = V::fmadd(xp, L::load(wp + 2 * w), acc2);
+            acc3 = V::fmadd(xp, L::load(wp + 3 * w), acc3);
+        }
+        V::store(y + j, finish(acc0));
+        V::store(y + j + w, finish(acc1));
+        V::store(y + j + 2 * w, finish(acc2));
+        V::store(y + j + 3 * w, finish(acc3));
+    }
+    for (; j + w <= n; j += w)
+    {
+        typename V::reg acc = init(j);
+        const TW *wp = W + j;
+        for (size_t p = 0; p < k; ++p, wp += ldw)
+            acc = V::fmadd(V::set1(x[p]), L::load(wp), acc);
+        V::store(y + j, finish(acc));
+    }
+    // 不足一个寄存器的尾部列
+    for (; j < n; ++j)
+    {
+        T acc = bias ? bias[j] : static_cast<T>(0);
+        const TW *wp = W + j;
+        for (size_t p = 0; p < k; ++p, wp += ldw)
+            acc += x[p] * static_cast<T>(*wp);
+        y[j] = relu ? std::max(acc, static_cast<T>(0)) : acc;
+    }
+}
+
+// 稀疏行更新: y += sum_p coef[p] * W[rows[p], :],W为行距ldw的矩阵,只读取k行
+// 用于输入只有少数元素变化时增量更新线性层的输出(预激活),y每个寄存器块只读写一次
+template <typename T, typename TW = T>
+void gemv_rows(const uint32_t *rows, const T *coef, size_t k, const TW *W, size_t ldw, T *y, size_t n)
+{
+    using V = Simd<T>;
+    using L = WidenLoad<T, TW>;
+    constexpr size_t w = V::width;
+    size_t j = 0;
+    for (; j + 4 * w <= n; j += 4 * w)
+    {
+        typename V::reg acc0 = V::load(y + j), acc1 = V::load(y + j + w), acc2 = V::load(y + j + 2 * w),
+                        acc3 = V::load(y + j + 3 * w);
+        for (size_t p = 0; p < k; ++p)
+        {
+            const TW *wp = W + rows[p] * ldw + j;
+            typename V::reg c = V::set1(coef[p]);
+            acc0 = V::fmadd(c, L::load(wp), acc0);
+            acc1 = V::fmadd(c, L::load(wp + w), acc1);
+            acc2 = V::fmadd(c, L::load(wp + 2 * w), acc2);
+            acc3 = V::fmadd(c, L::load(wp + 3 * w), acc3);
+        }
+        V::store(y + j, acc0);
+        V::store(y + j + w, acc1);
+        V::store(y + j + 2 * w, acc2);
+        V::store(y + j + 3 * w, acc3);
+    }
+    for (; j + w <= n; j += w)
+    {
+        typename V::reg acc = V::load(y + j);
+        for (size_t p = 0; p < k; ++p)
+            acc = V::fmadd(V::set1(coef[p]), L::load(W + rows[p] * ldw + j), acc);
+        V::store(y + j, acc);
+    }
+    for (; j < n; ++j)
+    {
+        T acc = y[j];
+        for (size_t p = 0; p < k; ++p)
+            acc += coef[p] * static_cast<T>(W[rows[p] * ldw + j]);
+        y[j] = acc;
+    }
+}
+
+// 分块GEMM的参数
+// 微内核每次算GEMM_MR x GEMM_NR的C块,累加器全部放在寄存器里;
+// A按GEMM_MC x GEMM_KC打包(留在L1/L2),B按GEMM_KC x gemm_nc打包(约512KB,留在L2)
+#define GEMM_MR 6
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_L2_BYTES (512 * 1024)
+
+template <typename T>
+constexpr size_t gemm_nr() { return 2 * Simd<T>::width; }
+
+template <typename T>
+constexpr size_t gemm_nc()
+{
+    return GEMM_L2_BYTES / (GEMM_KC * sizeof(T)) / gemm_nr<T>() * gemm_nr<T>();
+}
+
+// 把B[0:kc, 0:nc]按NR列一组打包,每组内按行连续存放,不足NR列补0
+// B为16位存储时在打包的同时展开成T,微内核不需要关心存储格式
+template <typename T, typename TB>
+void gemm_pack_b(const TB *B, size_t ldb, size_t kc, size_t nc, T *packed)
+{
+    constexpr size_t NR = gemm_nr<T>();
+    for (size_t j = 0; j < nc; j += NR)
+    {
+        size_t cols = std::min(NR, nc - j);
+        for (size_t p = 0; p < kc; ++p)
+        {
+            const TB *src = B + p * ldb + j;
+            size_t c = 0;
+            if (cols == NR)
+            {
+                for (; c < NR; c += Simd<T>::width)
+                    Simd<T>::store(packed + c, WidenLoad<T, TB>::load(src + c));
+            }
+            for (; c < cols; ++c)
+                packed[c] = static_cast<T>(src[c]);
+            for (; c < NR; ++c)
+                packed[c] = static_cast<T>(0);
+            packed += NR;
+        }
+    }
+}
+
+// 把A[0:mc, 0:kc]按MR行一组打包,每组内按列连续存放,不足MR行补0
+template <typename T>
+void gemm_pack_a(const T *A, size_t lda, size_t mc, size_t kc, T *packed)
+{
+    for (size_t i = 0; i < mc; i += GEMM_MR)
+    {
+        size_t rows = std::min<size_t>(GEMM_MR, mc - i);
+        for (size_t p = 0; p < kc; ++p)
+        {
+            size_t r = 0;
+            for (; r < rows; ++r)
+                packed[r] = A[(i + r) * lda + p];
+            for (; r < GEMM_MR; ++r)
+                packed[r] = static_cast<T>(0);
+            packed += GEMM_MR;
+        }
+    }
+}
+
+// 微内核: C[0:mr, 0:nr] (+)= Apanel * Bpanel, accumulate为false时覆盖C
+// 最后一个k块写回时顺便加上bias(可为空)并做ReLU
+template <typename T>
+void gemm_micro(size_t kc, const T *Ap, const T *Bp, T *C, size_t ldc, size_t mr, size_t nr, bool accumulate,
+                const T *bias, bool relu)
+{
+    using V = Simd<T>;
+    constexpr size_t w = V::width;
+    constexpr size_t NR = gemm_nr<T>();
+    typename V::reg acc[GEMM_MR][2];
+    for (size_t r = 0; r < GEMM_MR; ++r)
+        acc[r][0] = acc[r][1] = V::zero();
+
+    for (size_t p = 0; p < kc; ++p, Ap += GEMM_MR, Bp += NR)
+    {
+        typename V::reg b0 = V::load(Bp), b1 = V::load(Bp + w);
+        for (size_t r = 0; r < GEMM_MR; ++r)
+        {
+            typename V::reg a = V::set1(Ap[r]);
+            acc[r][0] = V::fmadd(a, b0, acc[r][0]);
+            acc[r][1] = V::fmadd(a, b1, acc[r][1]);
+        }
+    }
+
+    if (mr == GEMM_MR && nr == NR)
+    {
+        typename V::reg b0 = bias ? V::load(bias) : V::zero(), b1 = bias ? V::load(bias + w) : V::zero();
+        for (size_t r = 0; r < GEMM_MR; ++r)
+        {
+            T *c = C + r * ldc;
+            if (accumulate)
+            {
+                acc[r][0] = V::add(acc[r][0], V::load(c));
+                acc[r][1] = V::add(acc[r][1], V::load(c + w));
+            }
+            acc[r][0] = V::add(acc[r][0], b0);
+            acc[r][1] = V::add(acc[r][1], b1);
+            if (relu)
+            {
+                acc[r][0] = V::max(acc[r][0], V::zero());
+                acc[r][1] = V::max(acc[r][1], V::zero());
+            }
+            V::store(c, acc[r][0]);
+            V::store(c + w, acc[r][1]);
+        }
+        return;
+    }
+    // 边缘块: 先写到临时缓冲区再拷贝有效部分
+    T tile[GEMM_MR * NR];
+    for (size_t r = 0; r < GEMM_MR; ++r)
+    {
+        V::store(tile + r * NR, acc[r][0]);
+        V::store(tile + r * NR + w, acc[r][1]);
+    }
+    for (size_t r = 0; r < mr; ++r)
+        for (size_t c = 0; c < nr; ++c)
+        {
+            T v = accumulate ? C[r * ldc + c] + tile[r * NR + c] : tile[r * NR + c];
+            if (bias)
+                v += bias[c];
+            C[r * ldc + c] = relu ? std::max(v, static_cast<T>(0)) : v;
+        }
+}
+
+// 分块矩阵乘: C[0:m, 0:n] = A[0:m, 0:k] * B[0:k, 0:n],三个矩阵都是行优先
+// 打包缓冲区按线程复用,单线程执行,并行由调用者按行或列切分
+// bias(1 x n,可为空)和relu与gemv相同,在最后一个k块写回时完成; B可以是fp16_t/bf16_t存储
+template <typename T, typename TB = T>
+void gemm(size_t m, size_t n, size_t k, const T *A, size_t lda, const TB *B, size_t ldb, T *C, size_t ldc,
+          const T *bias = nullptr, bool relu = false)
+{
+    constexpr size_t NR = gemm_nr<T>();
+    constexpr size_t NC = gemm_nc<T>();
+    if (k == 0)
+    {
+        for (size_t i = 0; i < m; ++i)
+            for (size_t j = 0; j < n; ++j)
+            {
+                T v = bias ? bias[j] : static_cast<T>(0);
+                C[i * ldc + j] = relu ? std::max(v, static_cast<T>(0)) : v;
+            }
+        return;
+    }
+    thread_local std::vector<T> packA, packB;
+    packA.resize(GEMM_MC * GEMM_KC);
+    packB.resize(GEMM_KC * NC);
+
+    for (size_t jc = 0; jc < n; jc += NC)
+    {
+        size_t nc = std::min(NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += GEMM_KC)
+        {
+            size_t kc = std::min<size_t>(GEMM_KC, k - pc);
+            gemm_pack_b(B + pc * ldb + jc, ldb, kc, nc, packB.data());
+            for (size_t ic = 0; ic < m; ic += GEMM_MC)
+            {
+                size_t mc = std::min<size_t>(GEMM_MC, m - ic);
+                gemm_pack_a(A + ic * lda + pc, lda, mc, kc, packA.data());
+                bool last = pc + kc == k;
+                for (size_t jr = 0; jr < nc; jr += NR)
+                    for (size_t ir = 0; ir < mc; ir += GEMM_MR)
+                        gemm_micro(kc, packA.data() + ir * kc, packB.data() + jr * kc,
+                                   C + (ic + ir) * ldc + jc + jr, ldc,
+                                   std::min<size_t>(GEMM_MR, mc - ir), std::min(NR, nc - jr), pc != 0,
+                                   last && bias ? bias + jc + jr : nullptr, last && relu);
+            }
+        }
+    }
+}
+
+// 一行的最大值
+template <typename T>
+T row_max(const T *x, size_t n)
+{
+    using V = Simd<T>;
+    constexpr size_t w = V::width;
+    T m = -std::numeric_limits<T>::infinity();
+    size_t j = 0;
+    if (n >= w)
+    {
+        typename V::reg acc = V::load(x);
+        for (j = w; j + w <= n; j += w)
+            acc = V::max(acc, V::load(x + j));
+        m = V::reduce_max(acc);
+    }
+    for (; j < n; ++j)
+        m = std::max(m, x[j]);
+    return m;
+}
+
+// y[j] = exp(x[j] - shift),返回它们的和; y为nullptr时只求和
+template <typename T>
+T exp_shifted_sum(const T *x, T *y, size_t n, T shift)
+{
+    using V = Simd<T>;
+    constexpr size_t w = V::width;
+    typename V::reg sh = V::set1(shift), acc = V::zero();
+    size_t j = 0;
+    for (; j + w <= n; j += w)
+    {
+        typename V::reg e = V::exp(V::sub(V::load(x + j), sh));
+        if (y)
+            V::store(y + j, e);
+        acc = V::add(acc, e);
+    }
+    T sum = V::reduce_add(acc);
+    for (; j < n; ++j)
+    {
+        T e = std::exp(x[j] - shift);
+        if (y)
+            y[j] = e;
+        sum += e;
+    }
+    return sum;
+}
+
+// 数值稳定的softmax: 先减去最大值再求exp,大的logit不会溢出成inf/NaN
+template <typename T>
+void softmax_row(const T *x, T *y, size_t n)
+{
+    if (n == 0)
+        return;
+    T m = row_max(x, n);
+    T inv = static_cast<T>(1) / exp_shifted_sum(x, y, n, m);
+    for (size_t j = 0; j < n; ++j)
+        y[j] *= inv;
+}
+
+// log-softmax: y[j] = x[j] - max - log(sum(exp(x - max)))
+template <typename T>
+void log_softmax_row(const T *x, T *y, size_t n)
+{
+    if (n == 0)
+        return;
+    T m = row_max(x, n);
+    T shift = m + std::log(exp_shifted_sum(x, static_cast<T *>(nullptr), n, m));
+    for (size_t j = 0; j < n; ++j)
+        y[j] = x[j] - shift;
+}
+
+// 只要最可能的类别时使用: 返回argmax,prob写入该类别的softmax概率,不生成完整的输出
+template <typename T>
+size_t argmax_softmax_row(const T *x, size_t n, T *prob)
+{
+    size_t best = 0;
+    for (size_t j = 1; j < n; ++j)
+        if (x[j] > x[best])
+            best = j;
+    if (prob)
+        *prob = n == 0 ? static_cast<T>(0) : static_cast<T>(1) / exp_shifted_sum(x, static_cast<T *>(nullptr), n, x[best]);
+    return best;
+}
+
+// ---------------- int8量化内核 ----------------
+// 激活量化为0~127的uint8(ReLU输出和像素都非负),权重按输出通道量化为-127~127的int8,
+// 乘积累加到int32. 激活只用7位,AVX2的maddubs两两相加时不会饱和(127*127*2 < 32767).
+
+// k方向补齐到4的倍数
+inline size_t int8_padded_k(size_t k) { return (k + 3) / 4 * 4; }
+
+// 打包int8权重: W为k x n行优先,每4个相邻的k为一组,组内每列连续4个字节
+// packed[(p / 4) * n * 4 + j * 4 + r] = W[p + r][j],不足的k补0; packed长度为int8_padded_k(k) * n
+inline void pack_int8_weights(const int8_t *W, size_t k, size_t n, int8_t *packed)
+{
+    size_t kp = int8_padded_k(k);
+    for (size_t g = 0; g < kp / 4; ++g)
+        for (size_t j = 0; j < n; ++j)
+            for (size_t r = 0; r < 4; ++r)
+            {
+                size_t p = g * 4 + r;
+                packed[(g * n + j) * 4 + r] = p < k ? W[p * n + j] : 0;
+            }
+}
+
+// acc[0:n] = x[0:kp] * W,x长度为int8_padded_k(k)且补齐部分为0,W为pack_int8_weights的结果
+// 有VNNI时用dpbusd一条指令完成4组u8*s8累加,否则AVX2用maddubs+madd
+inline void gemv_int8(const uint8_t *x, const int8_t *packed, size_t kp, size_t n, int32_t *acc)
+{
+    size_t groups = kp / 4, rowBytes = n * 4;
+    size_t j = 0;
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512VNNI__)
+    for (; j + 64 <= n; j += 64)
+    {
+        __m512i a0 = _mm512_setzero_si512(), a1 = a0, a2 = a0, a3 = a0;
+        const int8_t *wp = packed + j * 4;
+        for (size_t g = 0; g < groups; ++g, wp += rowBytes)
+        {
+            int32_t xv;
+            std::memcpy(&xv, x + g * 4, 4);
+            __m512i xb = _mm512_set1_epi32(xv);
+            a0 = _mm512_dpbusd_epi32(a0, xb, _mm512_loadu_si512(wp));
+            a1 = _mm512_dpbusd_epi32(a1, xb, _mm512_loadu_si512(wp + 64));
+            a2 = _mm512_dpbusd_epi32(a2, xb, _mm512_loadu_si512(wp + 128));
+            a3 = _mm512_dpbusd_epi32(a3, xb, _mm512_loadu_si512(wp + 192));
+        }
+        _mm512_storeu_si512(acc + j, a0);
+        _mm512_storeu_si512(acc + j + 16, a1);
+        _mm512_storeu_si512(acc + j + 32, a2);
+        _mm512_storeu_si512(acc + j + 48, a3);
+    }
+    for (; j + 16 <= n; j += 16)
+    {
+        __m512i a = _mm512_setzero_si512();
+        const int8_t *wp = packed + j * 4;
+        for (size_t g = 0; g < groups; ++g, wp += rowBytes)
+        {
+            int32_t xv;
+            std::memcpy(&xv, x + g * 4, 4);
+            a = _mm512_dpbusd_epi32(a, _mm512_set1_epi32(xv), _mm512_loadu_si512(wp));
+        }
+        _mm512_storeu_si512(acc + j, a);
+    }
+#endif
+#if defined(__AVX2__)
+#if !defined(__AVXVNNI__)
+    const __m256i ones = _mm256_set1_epi16(1); // 把maddubs的16位结果两两相加成32位
+#endif
+    for (; j + 32 <= n; j += 32)
+    {
+        __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+        const int8_t *wp = packed + j * 4;
+        for (size_t g = 0; g < groups; ++g, wp += rowBytes)
+        {
+            int32_t xv;
+            std::memcpy(&xv, x + g * 4, 4);
+            __m256i xb = _mm256_set1_epi32(xv);
+            __m256i w0 = _mm256_loadu_si256((const __m256i *)wp), w1 = _mm256_loadu_si256((const __m256i *)(wp + 32));
+            __m256i w2 = _mm256_loadu_si256((const __m256i *)(wp + 64)), w3 = _mm256_loadu_si256((const __m256i *)(wp + 96));
+#if defined(__AVXVNNI__)
+            a0 = _mm256_dpbusd_avx_epi32(a0, xb, w0);
+            a1 = _mm256_dpbusd_avx_epi32(a1, xb, w1);
+            a2 = _mm256_dpbusd_avx_epi32(a2, xb, w2);
+            a3 = _mm256_dpbusd_avx_epi32(a3, xb, w3);
+#else
+            a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_maddubs_epi16(xb, w0), ones));
+            a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_maddubs_epi16(xb, w1), ones));
+            a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_maddubs_epi16(xb, w2), ones));
+            a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_maddubs_epi16(xb, w3), ones));
+#endif
+        }
+        _mm256_storeu_si256((__m256i *)(acc + j), a0);
+        _mm256_storeu_si256((__m256i *)(acc + j + 8), a1);
+        _mm256_storeu_si256((__m256i *)(acc + j + 16), a2);
+        _mm256_storeu_si256((__m256i *)(acc + j + 24), a3);
+    }
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256i a = _mm256_setzero_si256();
+        const int8_t *wp = packed + j * 4;
+        for (size_t g = 0; g < groups; ++g, wp += rowBytes)
+        {
+            int32_t xv;
+            std::memcpy(&xv, x + g * 4, 4);
+            __m256i xb = _mm256_set1_epi32(xv), w = _mm256_loadu_si256((const __m256i *)wp);
+#if defined(__AVXVNNI__)
+            a = _mm256_dpbusd_avx_epi32(a, xb, w);
+#else
+            a = _mm256_add_epi32(a, _mm256_madd_epi16(_mm256_maddubs_epi16(xb, w), ones));
+#endif
+        }
+        _mm256_storeu_si256((__m256i *)(acc + j), a);
+    }
+#endif
+    // 尾部列
+    for (; j < n; ++j)
+    {
+        int32_t a = 0;
+        const int8_t *wp = packed + j * 4;
+        for (size_t g = 0; g < groups; ++g, wp += rowBytes)
+            for (size_t r = 0; r < 4; ++r)
+                a += static_cast<int32_t>(x[g * 4 + r]) * wp[r];
+        acc[j] = a;
+    }
+}
+
+// 像素转float: dst[i] = src[i] * scale,用于把0~255的uint8像素直接归一化到计算缓冲区
+inline void u8_to_float(const uint8_t *src, float *dst, size_t n, float scale)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512 s = _mm512_set1_ps(scale);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), s));
+    }
+#elif defined(__AVX2__)
+    __m256 s = _mm256_set1_ps(scale);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = src[i] * scale;
+}
+
+// 像素累加: dst[i] += src[i] * w
+inline void u8_fmadd(const uint8_t *src, float *dst, size_t n, float w)
+{
+    size_t i = 0;
+#if defined(__AVX512F__)
+    __m512 s = _mm512_set1_ps(w);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_fmadd_ps(_mm512_cvtepi32_ps(v), s, _mm512_loadu_ps(dst + i)));
+    }
+#elif defined(__AVX2__)
+    __m256 s = _mm256_set1_ps(w);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_cvtepi32_ps(v), s, _mm256_loadu_ps(dst + i)));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] += src[i] * w;
+}
+
+// 长度n的区间缩放成若干段,第k段覆盖[k * ratio, (k + 1) * ratio),返回它与源像素p重叠的长度
+inline float area_overlap(size_t p, size_t k, float ratio)
+{
+    float lo = std::max((float)p, k * ratio), hi = std::min((float)(p + 1), (k + 1) * ratio);
+    return hi > lo ? hi - lo : 0.0f;
+}
+
+// 8位图像 -> 灰度 -> 按面积平均缩放到outRows x outCols -> 乘以scale,一次完成,不产生中间图像
+// src为rows x cols,每个像素channels个字节(1: 灰度, 3: BGR, 4: BGRA, 不支持2),行距step字节; dst行距dstStride个float
+// 只计算输出中[oy0, oy1) x [ox0, ox1)的格子,其余格子保持不变; 同一个格子单独计算和整体计算的结果完全相同
+// 灰度是通道的线性组合,先按面积平均再转灰度,结果与先转灰度再平均相同;
+// 每个输出行先把覆盖的源行按权重累加到acc(由调用者提供,cols * channels个float总是够用),这是主要的计算量,用SIMD完成,
+// 再在acc上做水平方向的面积平均和灰度转换
+inline void gray_area_resize_cells(const uint8_t *src, size_t rows, size_t cols, size_t step, size_t channels,
+                                   float *dst, size_t outRows, size_t outCols, size_t dstStride, float scale, float *acc,
+                                   size_t oy0, size_t oy1, size_t ox0, size_t ox1)
+{
+    // 与cv::COLOR_BGR2GRAY相同的系数,BGRA的alpha不参与
+    const float gray[3] = {0.114f, 0.587f, 0.299f};
+    float sy = (float)rows / outRows, sx = (float)cols / outCols;
+    float norm = scale / (sx * sy);
+    // 这些格子覆盖的源列
+    size_t first = (size_t)(ox0 * sx), last = std::min(cols, (size_t)std::ceil(ox1 * sx));
+    size_t span = last - first, width = span * channels;
+    for (size_t y = oy0; y < oy1; ++y)
+    {
+        // 垂直方向: 覆盖这一输出行的源行按重叠长度加权
+        size_t r0 = (size_t)(y * sy), r1 = std::min(rows, (size_t)std::ceil((y + 1) * sy));
+        std::fill(acc, acc + width, 0.0f);
+        for (size_t r = r0; r < r1; ++r)
+            u8_fmadd(src + r * step + first * channels, acc, width, area_overlap(r, y, sy));
+
+        // 转成灰度,原地写到acc的前span个元素(第c个灰度值只覆盖已经读过的位置)
+        if (channels > 1)
+            for (size_t c = 0; c < span; ++c)
+            {
+                const float *p = acc + c * channels;
+                acc[c] = gray[0] * p[0] + gray[1] * p[1] + gray[2] * p[2];
+            }
+
+        // 水平方向: 只有两端的源列部分重叠,中间的权重都是1
+        float *out = dst + y * dstStride;
+        for (size_t x = ox0; x < ox1; ++x)
+        {
+            size_t c0 = (size_t)(x * sx), c1 = std::min(cols, (size_t)std::ceil((x + 1) * sx));
+            float sum = area_overlap(c0, x, sx) * acc[c0 - first];
+            for (size_t c = c0 + 1; c + 1 < c1; ++c)
+                sum += acc[c - first];
+            if (c1 > c0 + 1)
+                sum += area_overlap(c1 - 1, x, sx) * acc[c1 - 1 - first];
+            out[x] = sum * norm;
+        }
+    }
+}
+
+// 整幅图像,acc为cols * channels个float
+inline void gray_area_resize(const uint8_t *src, size_t rows, size_t cols, size_t step, size_t channels,
+                             float *dst, size_t outRows, size_t outCols, size_t dstStride, float scale, float *acc)
+{
+    gray_area_resize_cells(src, rows, cols, step, channels, dst, outRows, outCols, dstStride, scale, acc,
+                           0, outRows, 0, outCols);
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
@@ -5,45 +6,110 @@
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <span>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <opencv2/opencv.hpp>
 #include <thread>
+#include <memory>
+#include <cstring>
+#include <new>
+#include "ThreadPool.h"
+#include "Kernels.h"
+#include "ModelMeta.h"
+#include "Client.h"
+#include "ShmTransport.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 1024
 
+#define MATRIX_ALIGNMENT 64          // 矩阵数据按缓存行对齐
+#define PARALLEL_MIN_WORK (1 << 16) // 每个并行块至少要做的乘加次数,更小的问题直接在调用线程计算
+
 using namespace std;
+
+// 按MATRIX_ALIGNMENT字节对齐的分配器,保证每块矩阵数据从缓存行边界开始
+template <typename T>
+struct AlignedAllocator
+{
+    using value_type = T;
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(MATRIX_ALIGNMENT)));
+    }
+    void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(MATRIX_ALIGNMENT)); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U> &) const { return true; }
+};
+
 template <typename T>
 class Matrix
 {
 private:
-    vector<vector<T>> data_;
-    size_t rows_; // 行数
-    size_t cols_; // 列数
+    std::vector<T, AlignedAllocator<T>> storage_; // 自有数据,行优先连续存储;视图时为空
+    T *data_;                                     // 指向首元素,自有矩阵指向storage_,视图指向外部内存
+    std::shared_ptr<const void> owner_;           // 视图所引用的外部内存(例如mmap映射)的持有者
+    size_t rows_;   // 行数
+    size_t cols_;   // 列数
+    size_t stride_; // 相邻两行首元素之间的距离(元素个数)
 public:
     // 构造函数
     Matrix(size_t rows, size_t cols);
     Matrix(size_t rows, size_t cols, const std::vector<std::vector<T>> &data);
-    Matrix(const Matrix &other); // 拷贝构造
+    Matrix(const Matrix &other);     // 拷贝构造,视图也拷贝成自有的紧凑矩阵
+    Matrix(Matrix &&other) noexcept; // 移动构造
+
+    // 创建不拥有数据的视图,owner保证外部内存在视图存活期间有效
+    // 只有view()和移动会共享内存; 拷贝总是复制数据,所以拷贝出来的矩阵可以随意修改
+    static Matrix view(T *data, size_t rows, size_t cols, size_t stride, std::shared_ptr<const void> owner = nullptr);
+    bool is_view() const { return owner_ != nullptr || (storage_.empty() && data_ != nullptr); }
+    const std::shared_ptr<const void> &owner() const { return owner_; }
 
     // 元素访问
     T &operator()(size_t row, size_t col);
     const T &operator()(size_t row, size_t col) const;
 
+    // 原始数据访问(不做越界检查,供计算内核使用)
+    T *data() { return data_; }
+    const T *data() const { return data_; }
+    T *row(size_t r) { return data_ + r * stride_; }
+    const T *row(size_t r) const { return data_ + r * stride_; }
+
     // 获取维度
     size_t rows() const { return rows_; }
     size_t cols() const { return cols_; }
+    size_t stride() const { return stride_; }
 
     // 矩阵运算
     Matrix<T> operator+(const Matrix<T> &other) const;
     Matrix<T> operator-(const Matrix<T> &other) const;
     Matrix<T> operator*(const Matrix<T> &other) const;
+    Matrix<T> add_row_vector(const Matrix<T> &vec) const; // 每一行都加上同一个1xN行向量(用于批量加偏置)
+
+    // 全连接层: out = this * W + bias(按行广播), relu为true时再做ReLU
+    // 偏置和ReLU在矩阵乘的累加器写回时一并完成,不产生中间矩阵; out须已是rows() x W.cols()
+    // parallel为false时在调用线程内完成,不经过线程池,也不做任何堆分配
+    // W可以是Matrix<fp16_t>/Matrix<bf16_t>,权重在内核里展开成T计算
+    template <typename TW>
+    void linear_into(const Matrix<TW> &W, const Matrix<T> *bias, bool relu, Matrix<T> &out, bool parallel = true) const;
+    Matrix<T> linear(const Matrix<T> &W, const Matrix<T> &bias) const;
+    Matrix<T> linear_relu(const Matrix<T> &W, const Matrix<T> &bias) const;
 
     // 重载赋值运算符
     Matrix<T> &operator=(const Matrix<T> &other);
+    Matrix<T> &operator=(Matrix<T> &&other) noexcept;
 
     // 打印矩阵
     void print() const;
@@ -51,10 +117,92 @@ public:
     // RELU函数
     Matrix<T> relu() const;
 
-    // SoftMax函数
+    // SoftMax函数(按行归一化,先减去每行最大值)
     Matrix<T> softmax() const;
+    Matrix<T> log_softmax() const;
+    // 每行最可能的类别及其softmax概率,不生成完整的softmax输出
+    std::vector<std::pair<size_t, T>> argmax_softmax() const;
+};
+
+// 只读映射的文件,析构时解除映射
+// 多个进程映射同一权重文件时共享页缓存中的同一份数据
+class MappedFile
+{
+public:
+    // 映射失败返回nullptr
+    static std::shared_ptr<const MappedFile> open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // 映射建立后文件描述符就不再需要
+        if (addr == MAP_FAILED)
+            return nullptr;
+        return std::shared_ptr<const MappedFile>(new MappedFile(addr, st.st_size));
+    }
+
+    ~MappedFile() { munmap(addr_, size_); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const void *data() const { return addr_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(void *addr, size_t size) : addr_(addr), size_(size) {}
+    void *addr_;
+    size_t size_;
 };
 
+// float接口的推理会话,见InferenceSession
+class InferenceSessionBase
+{
+public:
+    virtual ~InferenceSessionBase() = default;
+    // 输入N x input_size(),返回会话内部的N x output_size()输出,下一次调用前有效
+    virtual const Matrix<float> &forward(const Matrix<float> &input) = 0;
+    // 会话分配缓冲区的次数: 构造时一次,之后只有批次超过容量时才会增加
+    virtual size_t allocations() const = 0;
+
+    // 增量推理: 会话保存一份当前输入,之后只传入变化的元素,适合交互式或流式的客户端
+    // 设置完整的输入(n = input_size()个float),返回1 x output_size()的概率,下一次调用前有效
+    virtual const Matrix<float> &reset_input(const float *input, size_t n);
+    // 把保存的输入中下标为indices[i]的元素改为values[i],返回新的概率; 必须先调用过reset_input
+    // 默认实现更新保存的输入后完整计算一遍,支持的模型会覆盖为只计算变化部分
+    virtual const Matrix<float> &update_input(const uint32_t *indices, const float *values, size_t k);
+
+protected:
+    Matrix<float> deltaInput_ = Matrix<float>(0, 0); // reset_input保存的输入
+};
+
+inline const Matrix<float> &InferenceSessionBase::reset_input(const float *input, size_t n)
+{
+    if (deltaInput_.cols() != n)
+        deltaInput_ = Matrix<float>(1, n);
+    std::memcpy(deltaInput_.row(0), input, n * sizeof(float));
+    return forward(deltaInput_);
+}
+
+inline const Matrix<float> &InferenceSessionBase::update_input(const uint32_t *indices, const float *values, size_t k)
+{
+    if (deltaInput_.rows() == 0)
+        throw std::logic_error("reset_input must be called before update_input");
+    for (size_t i = 0; i < k; ++i)
+    {
+        if (indices[i] >= deltaInput_.cols())
+            throw std::out_of_range("Input index out of range");
+        deltaInput_.row(0)[indices[i]] = values[i];
+    }
+    return forward(deltaInput_);
+}
+
 // 基础模型类
 class modelbase
 {
@@ -63,23 +211,82 @@ public:
     modelbase(const string &path = "") : _path(path) {}
     virtual ~modelbase() = default;
     virtual const void predict(cv::Mat image) const = 0; // 纯虚函数
+    // 以float输入输出的前向计算,内部使用模型自己的计算类型
+    // 输入为N x input_size(),每行一个样本,输出为N x output_size()
+    virtual Matrix<float> forward(const Matrix<float> &input) const = 0;
+    virtual size_t input_size() const = 0;  // 输入维度,例如784
+    virtual size_t output_size() const = 0; // 输出维度,例如10
+    // 创建预分配好缓冲区的推理会话,每个线程一个,模型必须比会话活得久
+    virtual std::unique_ptr<InferenceSessionBase> make_session(size_t maxBatch = 1) const = 0;
+    void drawBarChart(const std::vector<float> &values, const std::string &windowName = "predict", int displayWidth = 800, int displayHeight = 600) const;
     std::string _path;
 };
 
+// 图像预处理: BGR图像 -> 灰度 -> 按面积平均缩放到28x28 -> 归一化到0~1,得到1x784的输入
+inline Matrix<float> preprocess(const cv::Mat &image);
+// 同上,直接写入调用者的缓冲区dst(784个float)并乘以scale,中间不生成任何图像
+// 每个线程有一个暂存行缓冲区,只在图像比以前的都宽时增长
+inline void preprocess_into(const cv::Mat &image, float *dst, float scale = 1.0f / 255.0f);
+// 增量预处理: 只重新计算被dirty区域(图像坐标)影响到的28x28格子,其余格子保留dst中上一次的结果
+// 返回更新过的格子范围(28x28坐标),结果与整幅重新计算完全相同
+inline cv::Rect preprocess_region(const cv::Mat &image, const cv::Rect &dirty, float *dst, float scale = 1.0f / 255.0f);
+// 批量预处理: images[i]写入out的第i行,out为n x 784; 在线程池上按图像并行
+inline void preprocess_batch(const cv::Mat *images, size_t n, Matrix<float> &out);
+// 同上但不归一化,把28x28的灰度像素写到pixels(784字节),用于以uint8发给服务端
+inline void preprocess_pixels(const cv::Mat &image, uint8_t *pixels);
+
+// 权重在内存中的存储格式
+// Native: 与计算类型T相同; FP16/BF16: 16位存储,内核读入时展开成float,累加仍是fp32,只能用于model<float>
+enum class WeightStorage
+{
+    Native,
+    FP16,
+    BF16,
+};
+
+// 按meta.json中的"type"选择计算类型并加载模型(fp32 -> model<float>, fp64 -> model<double>)
+// storage为FP16/BF16时总是model<float>
+inline std::shared_ptr<const modelbase> load_model(const string &path, WeightStorage storage = WeightStorage::Native);
+
+// 为模型目录写出16位权重文件<层名>.weight.fp16或.weight.bf16,之后加载时直接映射,不必再转换
+inline void save_half_weights(const string &dir, WeightStorage storage);
+
+// 多层全连接网络: 隐藏层使用ReLU,最后一层使用softmax
+// 层数,形状和权重存储类型都由模型目录下的meta.json决定
 template <typename T>
 class model : public modelbase
 {
 private:
-    std::vector<Matrix<T>> weights;
+    WeightStorage storage = WeightStorage::Native;
+    std::vector<LayerMeta> shapes;           // 各层的形状
+    std::vector<Matrix<T>> weights;          // Native存储的权重
+    std::vector<Matrix<fp16_t>> weightsFp16; // FP16存储的权重
+    std::vector<Matrix<bf16_t>> weightsBf16; // BF16存储的权重
     std::vector<Matrix<T>> biases;
 
 public:
-    model(const string &path = "");
+    // storage为FP16/BF16时优先映射目录下预先转换好的16位权重文件,没有则加载后转换
+    model(const string &path = "", WeightStorage storage = WeightStorage::Native);
     model(const model &other);
     Matrix<float> socket_predict(const Matrix<float> &input) const; // 有socket通信的预测函数
+    Matrix<float> socket_predict(const uint8_t *pixels) const;      // 同上,发送784个0~255的原始像素
     Matrix<T> _predict(const Matrix<T> &input) const;               // 无socket通信的预测函数
+    Matrix<T> predict_batch(const Matrix<T> &inputs) const;         // 批量预测,N x 784输入,N x 10输出
+    Matrix<T> predict_batch(std::span<const Matrix<T>> inputs) const; // 批量预测,输入为多个1x784矩阵
     virtual const void predict(cv::Mat image) const;                // 包装预测函数
-    void drawBarChart(const std::vector<T> &values, const std::string &windowName = "predict", int displayWidth = 800, int displayHeight = 600) const;
+    virtual Matrix<float> forward(const Matrix<float> &input) const;
+    virtual size_t input_size() const { return shapes.front().in; }
+    virtual size_t output_size() const { return shapes.back().out; }
+    virtual std::unique_ptr<InferenceSessionBase> make_session(size_t maxBatch = 1) const;
+    size_t layers() const { return shapes.size(); }
+    size_t layer_out(size_t l) const { return shapes[l].out; }
+    WeightStorage weight_storage() const { return storage; }
+    const Matrix<T> &weight(size_t l) const { return weights[l]; } // 只在Native存储时可用
+    const Matrix<T> &bias(size_t l) const { return biases[l]; }
+    // 第l层: out = x * W + bias, relu为true时再做ReLU; 按权重的存储格式选择内核
+    void layer_into(size_t l, const Matrix<T> &x, bool relu, Matrix<T> &out, bool parallel = true) const;
+    // 第l层输入只有k个元素变化时更新一行预激活: y += sum_p delta[p] * W[rows[p], :]
+    void layer_update(size_t l, const uint32_t *rows, const T *delta, size_t k, T *y) const;
 };
 
 // 函数实现
@@ -87,31 +294,72 @@ public:
 // 默认构造函数：初始化全零矩阵
 template <typename T>
 Matrix<T>::Matrix(size_t rows, size_t cols)
-    : rows_(rows), cols_(cols), data_(rows, std::vector<T>(cols, static_cast<T>(0))) {}
+    : storage_(rows * cols, static_cast<T>(0)), data_(storage_.data()), rows_(rows), cols_(cols), stride_(cols) {}
 
 // 使用二维数组初始化
 template <typename T>
 Matrix<T>::Matrix(size_t rows, size_t cols, const std::vector<std::vector<T>> &data)
-    : rows_(rows), cols_(cols), data_(data)
+    : storage_(rows * cols), data_(storage_.data()), rows_(rows), cols_(cols), stride_(cols)
 {
     if (data.size() != rows || data[0].size() != cols)
         throw std::invalid_argument("Data dimension mismatch");
+    for (size_t i = 0; i < rows; ++i)
+        std::memcpy(row(i), data[i].data(), cols * sizeof(T));
 }
 
-// 拷贝构造函数
+// 拷贝构造函数: 总是深拷贝,视图(例如只读映射的权重)拷贝后也是可写的自有矩阵
+template <typename T>
+Matrix<T>::Matrix(const Matrix &other) : Matrix(other.rows_, other.cols_)
+{
+    for (size_t i = 0; i < rows_; ++i)
+        std::memcpy(row(i), other.row(i), cols_ * sizeof(T));
+}
+
+// 移动构造函数(vector移动后缓冲区地址不变,data_可以直接沿用)
+template <typename T>
+Matrix<T>::Matrix(Matrix &&other) noexcept
+    : storage_(std::move(other.storage_)), data_(other.data_), owner_(std::move(other.owner_)),
+      rows_(other.rows_), cols_(other.cols_), stride_(other.stride_)
+{
+    other.data_ = nullptr;
+    other.rows_ = other.cols_ = other.stride_ = 0;
+}
+
+// 创建视图
 template <typename T>
-Matrix<T>::Matrix(const Matrix &other)
-    : rows_(other.rows_), cols_(other.cols_), data_(other.data_) {}
+Matrix<T> Matrix<T>::view(T *data, size_t rows, size_t cols, size_t stride, std::shared_ptr<const void> owner)
+{
+    Matrix result(0, 0);
+    result.data_ = data;
+    result.owner_ = std::move(owner);
+    result.rows_ = rows;
+    result.cols_ = cols;
+    result.stride_ = stride;
+    return result;
+}
 
 // 重载赋值运算符
 template <typename T>
 Matrix<T> &Matrix<T>::operator=(const Matrix &other)
+{
+    if (this != &other)
+        *this = Matrix(other);
+    return *this;
+}
+
+template <typename T>
+Matrix<T> &Matrix<T>::operator=(Matrix &&other) noexcept
 {
     if (this != &other)
     {
         rows_ = other.rows_;
         cols_ = other.cols_;
+        stride_ = other.stride_;
+        storage_ = std::move(other.storage_);
         data_ = other.data_;
+        owner_ = std::move(other.owner_);
+        other.data_ = nullptr;
+        other.rows_ = other.cols_ = other.stride_ = 0;
     }
     return *this;
 }
@@ -122,7 +370,7 @@ T &Matrix<T>::operator()(size_t row, size_t col)
 {
     if (row >= rows_ || col >= cols_)
         throw std::out_of_range("Matrix index out of range");
-    return data_[row][col];
+    return data_[row * stride_ + col];
 }
 
 template <typename T>
@@ -130,7 +378,7 @@ const T &Matrix<T>::operator()(size_t row, size_t col) const
 {
     if (row >= rows_ || col >= cols_)
         throw std::out_of_range("Matrix index out of range");
-    return data_[row][col];
+    return data_[row * stride_ + col];
 }
 
 // 矩阵的加法
@@ -141,8 +389,31 @@ Matrix<T> Matrix<T>::operator+(const Matrix<T> &other) const
         throw std::invalid_argument("Matrix dimensions do not match for addition");
     Matrix result(rows_, cols_);
     for (size_t i = 0; i < rows_; ++i)
+    {
+        const T *a = row(i);
+        const T *b = other.row(i);
+        T *c = result.row(i);
+        for (size_t j = 0; j < cols_; ++j)
+            c[j] = a[j] + b[j];
+    }
+    return result;
+}
+
+// 按行广播的加法
+template <typename T>
+Matrix<T> Matrix<T>::add_row_vector(const Matrix<T> &vec) const
+{
+    if (vec.rows_ != 1 || vec.cols_ != cols_)
+        throw std::invalid_argument("Row vector dimension does not match for broadcast addition");
+    Matrix result(rows_, cols_);
+    const T *b = vec.row(0);
+    for (size_t i = 0; i < rows_; ++i)
+    {
+        const T *a = row(i);
+        T *c = result.row(i);
         for (size_t j = 0; j < cols_; ++j)
-            result(i, j) = data_[i][j] + other.data_[i][j];
+            c[j] = a[j] + b[j];
+    }
     return result;
 }
 
@@ -157,51 +428,100 @@ Matrix<T> Matrix<T>::operator*(const Matrix<T> &other) const
     // for (size_t i = 0; i < rows_; ++i)
     //     for (size_t j = 0; j < other.cols_; ++j)
     //         for (size_t k = 0; k < cols_; ++k)
-    //             result(i, j) += data_[i][k] * other.data_[k][j];
+    //             result(i, j) += (*this)(i, k) * other(k, j);
 
-    // 优化版
-    int ThreadNum = std::thread::hardware_concurrency(); // 获取CPU核心数
-    std::vector<std::thread> threads;                    // 存放线程
+    // 优化版: 见linear_into
+    linear_into(other, nullptr, false, result);
+    return result;
+}
 
-    // 将任务分配给多个线程
-    int rowsPerThread = rows_ / ThreadNum; // 每个线程处理的行数
-    for (int i = 0; i < ThreadNum; ++i)    // 创建线程
-    {
-        int startRow = i * rowsPerThread;                                     // 起始行
-        int endRow = (i == ThreadNum - 1) ? rows_ : startRow + rowsPerThread; // 结束行,最后一个线程处理剩余行
+// 全连接层
+template <typename T>
+Matrix<T> Matrix<T>::linear(const Matrix<T> &W, const Matrix<T> &bias) const
+{
+    Matrix result(rows_, W.cols_);
+    linear_into(W, &bias, false, result);
+    return result;
+}
 
-        // 创建线程并传递参数,创建时就会立即启动子线程
-        // lambda表达式传递参数
-        threads.emplace_back([this, startRow, endRow, &other, &result]()
-                             {
-                for (size_t i = startRow; i < endRow; ++i) {
-                    for (size_t j = 0; j < other.cols(); ++j) {
-                        for (size_t k = 0; k < this->cols_; ++k) {
-                            result(i, j) += this->data_[i][k] * other.data_[k][j];
-                        }
-                    }
-                } });
-    }
+template <typename T>
+Matrix<T> Matrix<T>::linear_relu(const Matrix<T> &W, const Matrix<T> &bias) const
+{
+    Matrix result(rows_, W.cols_);
+    linear_into(W, &bias, true, result);
+    return result;
+}
 
-    // 按顺序等待所有子线程完成
-    for (auto &t : threads)
+// 分块GEMM(单行输入用GEMV),在全局线程池上按较大的维度切分
+template <typename T>
+template <typename TW>
+void Matrix<T>::linear_into(const Matrix<TW> &other, const Matrix<T> *bias, bool relu, Matrix<T> &result, bool parallel) const
+{
+    if (cols_ != other.rows())
+        throw std::invalid_argument("Matrix dimensions do not match for multiplication");
+    if (result.rows_ != rows_ || result.cols_ != other.cols())
+        throw std::invalid_argument("Output matrix has wrong dimensions");
+    if (bias && (bias->rows_ != 1 || bias->cols_ != other.cols()))
+        throw std::invalid_argument("Row vector dimension does not match for broadcast addition");
+    const T *b = bias ? bias->row(0) : nullptr;
+    const TW *w = other.row(0);
+    size_t n = other.cols(), ldw = other.stride();
+
+    if (!parallel)
     {
-        if (t.joinable()) // 检查线程是否可连接
-            t.join();     // 等待线程完成
+        if (rows_ == 1)
+            gemv(row(0), w, ldw, result.row(0), cols_, n, b, relu);
+        else
+            gemm(rows_, n, cols_, row(0), stride_, w, ldw, result.row(0), result.stride_, b, relu);
+        return;
     }
 
-    return result;
+    ThreadPool &pool = ThreadPool::instance();
+    if (rows_ == 1)
+    {
+        // 1xN输入走专用的向量乘矩阵内核,按64列一块切给线程池
+        size_t grain = std::max<size_t>(1, PARALLEL_MIN_WORK / std::max<size_t>(1, cols_ * 64));
+        pool.parallel_for(0, (n + 63) / 64, grain, [&](size_t b0, size_t b1)
+                          {
+                              size_t j0 = b0 * 64, j1 = std::min(n, b1 * 64);
+                              gemv(row(0), w + j0, ldw, result.row(0) + j0, cols_, j1 - j0,
+                                   b ? b + j0 : nullptr, relu); });
+        return;
+    }
+    size_t rowWork = std::max<size_t>(1, n * cols_); // 每行的乘加次数
+    if (rows_ >= pool.size() * GEMM_MR)
+    {
+        // 行数足够: 按行切分,每块行数取GEMM_MR的倍数
+        size_t grain = std::max<size_t>(1, PARALLEL_MIN_WORK / (rowWork * GEMM_MR));
+        pool.parallel_for(0, (rows_ + GEMM_MR - 1) / GEMM_MR, grain, [&](size_t b0, size_t b1)
+                          {
+                              size_t i0 = b0 * GEMM_MR, i1 = std::min(rows_, b1 * GEMM_MR);
+                              gemm(i1 - i0, n, cols_, row(i0), stride_, w, ldw, result.row(i0), result.stride_,
+                                   b, relu); });
+    }
+    else
+    {
+        // 行数太少: 按列切分,每块列数取微内核宽度的倍数
+        constexpr size_t NR = gemm_nr<T>();
+        size_t grain = std::max<size_t>(1, PARALLEL_MIN_WORK / std::max<size_t>(1, rows_ * cols_ * NR));
+        pool.parallel_for(0, (n + NR - 1) / NR, grain, [&](size_t b0, size_t b1)
+                          {
+                              size_t j0 = b0 * NR, j1 = std::min(n, b1 * NR);
+                              gemm(rows_, j1 - j0, cols_, row(0), stride_, w + j0, ldw, result.row(0) + j0, result.stride_,
+                                   b ? b + j0 : nullptr, relu); });
+    }
 }
 
 // 打印矩阵
 template <typename T>
 void Matrix<T>::print() const
 {
-    for (const auto &row : data_)
+    for (size_t i = 0; i < rows_; ++i)
     {
-        for (const auto &val : row)
+        const T *r = row(i);
+        for (size_t j = 0; j < cols_; ++j)
         {
-            std::cout << val << " ";
+            std::cout << r[j] << " ";
         }
         std::cout << std::endl;
     }
@@ -216,7 +536,7 @@ Matrix<T> Matrix<T>::relu() const
     {
         for (size_t j = 0; j < cols_; ++j)
         {
-            result(i, j) = std::max(static_cast<T>(0), data_[i][j]);
+            result.row(i)[j] = std::max(static_cast<T>(0), row(i)[j]);
         }
     }
     return result;
@@ -227,205 +547,602 @@ template <typename T>
 Matrix<T> Matrix<T>::softmax() const
 {
     Matrix<T> result(rows_, cols_);
-    T sumExp = static_cast<T>(0);
     for (size_t i = 0; i < rows_; ++i)
-    {
+        softmax_row(row(i), result.row(i), cols_); // 每行单独归一化
+    return result;
+}
 
-        for (size_t j = 0; j < cols_; ++j)
-        {
-            result(i, j) = std::exp(data_[i][j]);
-            sumExp += result(i, j);
-        }
-    }
+// log-softmax函数
+template <typename T>
+Matrix<T> Matrix<T>::log_softmax() const
+{
+    Matrix<T> result(rows_, cols_);
     for (size_t i = 0; i < rows_; ++i)
-    {
-        for (size_t j = 0; j < cols_; ++j)
-        {
-            result(i, j) /= sumExp; // 归一化
-        }
-    }
+        log_softmax_row(row(i), result.row(i), cols_);
     return result;
 }
 
-// 构造函数
+// 每行的最大类别
 template <typename T>
-model<T>::model(const string &path)
-    : modelbase(path)
+std::vector<std::pair<size_t, T>> Matrix<T>::argmax_softmax() const
 {
+    std::vector<std::pair<size_t, T>> result(rows_);
+    for (size_t i = 0; i < rows_; ++i)
+        result[i].first = argmax_softmax_row(row(i), cols_, &result[i].second);
+    return result;
+}
 
-    // 读取二进制文件
-    vector<vector<T>> data[4];
-    vector<int> row, col;
-    if (path.ends_with("plus"))
+// 把mmap映射的权重文件变成Matrix<T>
+// 文件存储类型与T一致时直接返回视图,否则逐元素转换成自有矩阵
+template <typename T, typename S>
+Matrix<T> weight_from_file(const std::shared_ptr<const MappedFile> &file, size_t rows, size_t cols)
+{
+    const S *src = static_cast<const S *>(file->data());
+    if constexpr (std::is_same_v<T, S>)
     {
-        row = {784, 1, 1000, 1};
-        col = {1000, 1000, 10, 10};
+        return Matrix<T>::view(const_cast<T *>(src), rows, cols, cols, file);
     }
     else
     {
-        row = {784, 1, 500, 1};
-        col = {500, 500, 10, 10};
+        Matrix<T> result(rows, cols);
+        for (size_t i = 0; i < rows * cols; ++i)
+            result.data()[i] = static_cast<T>(src[i]);
+        return result;
     }
+}
 
-    string filename[] = {_path + "/fc1.weight", _path + "/fc1.bias", _path + "/fc2.weight", _path + "/fc2.bias"};
-    for (int k = 0; k < 4; k++)
+// 16位存储的权重: 有预先转换好的文件就直接映射,否则从已加载的权重W转换
+template <typename H, typename T>
+Matrix<H> half_weight(const string &filename, const Matrix<T> &W)
+{
+    std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+    if (file)
     {
-        FILE *pf = fopen(filename[k].c_str(), "rb");
-        if (!pf)
-        {
-            printf("fopen error!\n");
-            exit(-1);
-        }
+        if (file->size() < W.rows() * W.cols() * sizeof(H))
+            throw std::runtime_error("Weight file too small: " + filename);
+        return Matrix<H>::view(const_cast<H *>(static_cast<const H *>(file->data())), W.rows(), W.cols(), W.cols(), file);
+    }
+    Matrix<H> result(W.rows(), W.cols());
+    for (size_t i = 0; i < W.rows(); ++i)
+        for (size_t j = 0; j < W.cols(); ++j)
+            result.row(i)[j] = H(static_cast<float>(W.row(i)[j]));
+    return result;
+}
 
-        data[k].resize(row[k], vector<T>(col[k], static_cast<T>(0))); // 初始化为0
-        for (int i = 0; i < row[k]; i++)                              // 按行读取
+// 构造函数
+template <typename T>
+model<T>::model(const string &path, WeightStorage storage)
+    : modelbase(path), storage(storage)
+{
+    if (storage != WeightStorage::Native && !std::is_same_v<T, float>)
+        throw std::invalid_argument("FP16/BF16 weights require model<float>");
+    // 各层的形状,顺序和存储类型都来自meta.json
+    ModelMeta meta = ModelMeta::load(_path + "/meta.json");
+    size_t elem = dtype_size(meta.dtype);
+    shapes = meta.layers;
+
+    for (const LayerMeta &layer : meta.layers)
+    {
+        size_t row[] = {layer.in, 1};
+        size_t col[] = {layer.out, layer.out};
+        string filename[] = {_path + "/" + layer.name + ".weight", _path + "/" + layer.name + ".bias"};
+        for (int k = 0; k < 2; k++)
         {
-            fread(data[k][i].data(), sizeof(T), col[k], pf); // 读取一行数据
+            // 只读映射权重文件,存储类型一致时矩阵直接引用映射的内存,不再读入和拷贝
+            std::shared_ptr<const MappedFile> file = MappedFile::open(filename[k]);
+            if (!file)
+                throw std::runtime_error("Cannot map weight file " + filename[k]);
+            if (file->size() < row[k] * col[k] * elem)
+                throw std::runtime_error("Weight file too small: " + filename[k]);
+
+            Matrix<T> data = meta.dtype == DType::FP64 ? weight_from_file<T, double>(file, row[k], col[k])
+                                                       : weight_from_file<T, float>(file, row[k], col[k]);
+            if (k == 1)
+                biases.push_back(std::move(data));
+            else if (storage == WeightStorage::FP16)
+                weightsFp16.push_back(half_weight<fp16_t>(filename[0] + ".fp16", data));
+            else if (storage == WeightStorage::BF16)
+                weightsBf16.push_back(half_weight<bf16_t>(filename[0] + ".bf16", data));
+            else
+                weights.push_back(std::move(data));
         }
-        fclose(pf);
     }
-    weights.insert(weights.end(), {Matrix<T>(row[0], col[0], data[0]), Matrix<T>(row[2], col[2], data[2])});
-    biases.insert(biases.end(), {Matrix<T>(row[1], col[1], data[1]), Matrix<T>(row[3], col[3], data[3])});
+}
+
+// 模型的权重只读,拷贝模型时映射的权重继续共享同一份映射,自有的权重照常复制
+template <typename W>
+std::vector<Matrix<W>> share_weights(const std::vector<Matrix<W>> &src)
+{
+    std::vector<Matrix<W>> dst;
+    dst.reserve(src.size());
+    for (const Matrix<W> &m : src)
+        dst.push_back(m.owner() ? Matrix<W>::view(const_cast<W *>(m.data()), m.rows(), m.cols(), m.stride(), m.owner())
+                                : Matrix<W>(m));
+    return dst;
 }
 
 // 拷贝构造函数
 template <typename T>
 model<T>::model(const model &other)
-    : weights(other.weights), biases(other.biases) {}
+    : modelbase(other._path), storage(other.storage), shapes(other.shapes), weights(share_weights(other.weights)),
+      weightsFp16(share_weights(other.weightsFp16)), weightsBf16(share_weights(other.weightsBf16)),
+      biases(share_weights(other.biases)) {}
 
-// 预测函数(无socket通信)
 template <typename T>
-Matrix<T> model<T>::_predict(const Matrix<T> &input) const
+void model<T>::layer_into(size_t l, const Matrix<T> &x, bool relu, Matrix<T> &out, bool parallel) const
 {
+    if constexpr (std::is_same_v<T, float>)
+    {
+        if (storage == WeightStorage::FP16)
+            return x.linear_into(weightsFp16[l], &biases[l], relu, out, parallel);
+        if (storage == WeightStorage::BF16)
+            return x.linear_into(weightsBf16[l], &biases[l], relu, out, parallel);
+    }
+    x.linear_into(weights[l], &biases[l], relu, out, parallel);
+}
 
-    if (input.rows() != 1 || input.cols() != 784)
+template <typename T>
+void model<T>::layer_update(size_t l, const uint32_t *rows, const T *delta, size_t k, T *y) const
+{
+    size_t n = shapes[l].out;
+    if constexpr (std::is_same_v<T, float>)
     {
-        throw std::invalid_argument("Input dimension must be 1x784");
+        if (storage == WeightStorage::FP16)
+            return gemv_rows(rows, delta, k, weightsFp16[l].row(0), weightsFp16[l].stride(), y, n);
+        if (storage == WeightStorage::BF16)
+            return gemv_rows(rows, delta, k, weightsBf16[l].row(0), weightsBf16[l].stride(), y, n);
     }
-    Matrix<T> activation = input;
-    activation = (activation * weights[0] + biases[0]).relu();
-    activation = (activation * weights[1] + biases[1]).softmax();
-    return activation;
+    gemv_rows(rows, delta, k, weights[l].row(0), weights[l].stride(), y, n);
 }
 
-// 预测函数(有socket通信)
-template <>
-Matrix<float> model<float>::socket_predict(const Matrix<float> &input) const
+// 预测函数(无socket通信)
+template <typename T>
+Matrix<T> model<T>::_predict(const Matrix<T> &input) const
 {
 
-    if (input.rows() != 1 || input.cols() != 784)
+    if (input.rows() != 1 || input.cols() != input_size())
     {
-        throw std::invalid_argument("Input dimension must be 1x784");
+        throw std::invalid_argument("Input dimension must be 1x" + std::to_string(input_size()));
     }
+    return predict_batch(input);
+}
 
-    int clientSocket;              // 客户端套接字
-    struct sockaddr_in serverAddr; // 服务器地址结构
-    float buffer[BUFFER_SIZE];     // 发送和接收缓冲区
-
-    // 创建客户端套接字
-    clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket == -1)
+// 批量预测: 每层对整个批次做一次矩阵乘,权重只需从内存读一遍
+template <typename T>
+Matrix<T> model<T>::predict_batch(const Matrix<T> &inputs) const
+{
+    if (inputs.cols() != input_size())
     {
-        perror("Failed to create socket");
-        exit(EXIT_FAILURE);
+        throw std::invalid_argument("Input dimension must be Nx" + std::to_string(input_size()));
     }
+    // 隐藏层用融合的线性+偏置+ReLU,每层只产生一个输出矩阵
+    Matrix<T> activation(0, 0);
+    const Matrix<T> *x = &inputs;
+    for (size_t l = 0; l < layers(); ++l)
+    {
+        Matrix<T> out(inputs.rows(), shapes[l].out);
+        layer_into(l, *x, l + 1 < layers(), out);
+        activation = std::move(out);
+        x = &activation;
+    }
+    return activation.softmax();
+}
 
-    // 设置服务器地址信息
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(SERVER_PORT);
-    if (inet_pton(AF_INET, SERVER_IP, &(serverAddr.sin_addr)) <= 0)
+template <typename T>
+Matrix<T> model<T>::predict_batch(std::span<const Matrix<T>> inputs) const
+{
+    // 把多个1xN输入拼成一个批次
+    Matrix<T> batch(inputs.size(), input_size());
+    for (size_t i = 0; i < inputs.size(); ++i)
     {
-        perror("Failed to set server IP");
-        exit(EXIT_FAILURE);
+        if (inputs[i].rows() != 1 || inputs[i].cols() != input_size())
+            throw std::invalid_argument("Input dimension must be 1x" + std::to_string(input_size()));
+        std::memcpy(batch.row(i), inputs[i].row(0), input_size() * sizeof(T));
     }
+    return predict_batch(batch);
+}
 
-    // 连接到服务器
-    if (connect(clientSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == -1)
+// float接口的前向计算
+template <typename T>
+Matrix<float> model<T>::forward(const Matrix<float> &input) const
+{
+    if constexpr (std::is_same_v<T, float>)
     {
-        perror("Failed to connect to server");
-        exit(EXIT_FAILURE);
+        return predict_batch(input);
     }
+    else
+    {
+        Matrix<T> in(input.rows(), input.cols());
+        for (size_t i = 0; i < input.rows(); ++i)
+            for (size_t j = 0; j < input.cols(); ++j)
+                in.row(i)[j] = static_cast<T>(input.row(i)[j]);
+        Matrix<T> out = predict_batch(in);
+        Matrix<float> result(out.rows(), out.cols());
+        for (size_t i = 0; i < out.rows(); ++i)
+            for (size_t j = 0; j < out.cols(); ++j)
+                result.row(i)[j] = static_cast<float>(out.row(i)[j]);
+        return result;
+    }
+}
 
-    printf("Connected to server %s:%d\n", SERVER_IP, SERVER_PORT);
+// 按meta.json选择计算类型
+inline std::shared_ptr<const modelbase> load_model(const string &path, WeightStorage storage)
+{
+    if (storage != WeightStorage::Native)
+        return std::make_shared<const model<float>>(path, storage);
+    ModelMeta meta = ModelMeta::load(path + "/meta.json");
+    if (meta.dtype == DType::FP64)
+        return std::make_shared<const model<double>>(path);
+    return std::make_shared<const model<float>>(path);
+}
 
-    // 复制数据到缓冲区
-    for (size_t i = 0; i < 784; ++i)
+inline void save_half_weights(const string &dir, WeightStorage storage)
+{
+    if (storage == WeightStorage::Native)
+        throw std::invalid_argument("save_half_weights needs FP16 or BF16");
+    ModelMeta meta = ModelMeta::load(dir + "/meta.json");
+    model<float> m(dir); // fp64的权重在这里先转换成float
+    for (size_t l = 0; l < m.layers(); ++l)
     {
-        buffer[i] = input(0, i);
+        const Matrix<float> &W = m.weight(l);
+        std::vector<uint16_t> bits(W.rows() * W.cols());
+        for (size_t i = 0; i < W.rows(); ++i)
+            for (size_t j = 0; j < W.cols(); ++j)
+                bits[i * W.cols() + j] = storage == WeightStorage::FP16 ? fp16_t(W.row(i)[j]).bits : bf16_t(W.row(i)[j]).bits;
+
+        string filename = dir + "/" + meta.layers[l].name + ".weight" + (storage == WeightStorage::FP16 ? ".fp16" : ".bf16");
+        FILE *pf = fopen(filename.c_str(), "wb");
+        if (!pf)
+            throw std::runtime_error("Cannot write " + filename);
+        fwrite(bits.data(), sizeof(uint16_t), bits.size(), pf);
+        fclose(pf);
     }
-    // 发送数据
-    if (send(clientSocket, buffer, 784 * sizeof(float), 0) == -1)
+}
+
+// 推理会话: 按模型各层的形状一次性分配好所有激活缓冲区,之后每次推理都复用
+// 稳态下不做任何堆分配,计算在调用线程内完成,适合每个工作线程持有一个
+template <typename T>
+class InferenceSession : public InferenceSessionBase
+{
+public:
+    InferenceSession(const model<T> &m, size_t maxBatch = 1);
+
+    // 输入N x input_size(),返回会话内部的N x output_size()概率矩阵,下一次调用前有效
+    const Matrix<T> &predict(const Matrix<T> &input);
+    virtual const Matrix<float> &forward(const Matrix<float> &input);
+    virtual size_t allocations() const { return allocations_; }
+    size_t capacity() const { return capacity_; }
+
+    // 增量推理: 缓存第一层的预激活(ReLU之前); 第一层是线性的,k个输入变化时预激活只变化
+    // sum_p delta[p] * W1[i_p, :],只需读k行权重而不是整个input_size() x layer_out(0)的矩阵,后面各层照常计算
+    // 累计更新的元素数超过input_size()时完整重算一次第一层,避免舍入误差累积
+    virtual const Matrix<float> &reset_input(const float *input, size_t n);
+    virtual const Matrix<float> &update_input(const uint32_t *indices, const float *values, size_t k);
+
+private:
+    void reserve(size_t batch);
+    // 从第first层开始计算到最后并做softmax,x为第first层的输入(n行)
+    const Matrix<T> &run_layers(size_t first, const Matrix<T> &x, size_t n);
+    // T不是float时把输出转换到output_
+    const Matrix<float> &to_float(const Matrix<T> &out);
+    // 由preact_得到第一层输出,再算完后面各层
+    const Matrix<float> &finish_delta();
+
+    const model<T> &model_;
+    size_t capacity_ = 0;              // 当前缓冲区能容纳的最大批次
+    size_t allocations_ = 0;           // 分配缓冲区的次数
+    std::vector<Matrix<T>> buffers_;   // 每层输出的完整缓冲区, capacity_ x out
+    std::vector<Matrix<T>> views_;     // 本次批次大小的视图,指向buffers_
+    Matrix<T> input_;                  // T不是float时,转换后的输入缓冲区
+    Matrix<float> output_;             // T不是float时,转换后的输出缓冲区
+    Matrix<T> inputView_;
+    Matrix<float> outputView_;
+
+    Matrix<T> current_ = Matrix<T>(0, 0); // 增量推理的当前输入, 1 x input_size()
+    Matrix<T> preact_ = Matrix<T>(0, 0);  // 第一层的预激活, 1 x layer_out(0)
+    std::vector<uint32_t> changed_;       // 本次更新中变化的输入下标
+    std::vector<T> delta_;                // 对应的变化量
+    size_t drift_ = 0;                    // 上次完整计算第一层之后累计增量更新的元素数
+};
+
+template <typename T>
+InferenceSession<T>::InferenceSession(const model<T> &m, size_t maxBatch)
+    : model_(m), views_(m.layers(), Matrix<T>(0, 0)), input_(0, 0), output_(0, 0), inputView_(0, 0), outputView_(0, 0)
+{
+    reserve(std::max<size_t>(1, maxBatch));
+}
+
+template <typename T>
+void InferenceSession<T>::reserve(size_t batch)
+{
+    if (batch <= capacity_)
+        return;
+    buffers_.clear();
+    for (size_t l = 0; l < model_.layers(); ++l)
+        buffers_.emplace_back(batch, model_.layer_out(l));
+    if constexpr (!std::is_same_v<T, float>)
     {
-        perror("Failed to send data");
-        exit(EXIT_FAILURE);
+        input_ = Matrix<T>(batch, model_.input_size());
+        output_ = Matrix<float>(batch, model_.output_size());
     }
+    capacity_ = batch;
+    ++allocations_;
+}
 
-    // 接收响应
-    memset(buffer, 0, BUFFER_SIZE * sizeof(float));
-    if (recv(clientSocket, buffer, BUFFER_SIZE * sizeof(float), 0) == -1)
+template <typename T>
+const Matrix<T> &InferenceSession<T>::predict(const Matrix<T> &input)
+{
+    if (input.cols() != model_.input_size())
+        throw std::invalid_argument("Input dimension must be Nx" + std::to_string(model_.input_size()));
+    size_t n = input.rows();
+    reserve(n);
+    return run_layers(0, input, n);
+}
+
+template <typename T>
+const Matrix<T> &InferenceSession<T>::run_layers(size_t first, const Matrix<T> &input, size_t n)
+{
+    const Matrix<T> *x = &input;
+    for (size_t l = first; l < model_.layers(); ++l)
     {
-        perror("Failed to receive data");
-        exit(EXIT_FAILURE);
+        size_t cols = buffers_[l].cols();
+        views_[l] = Matrix<T>::view(buffers_[l].data(), n, cols, cols);
+        bool hidden = l + 1 < model_.layers();
+        model_.layer_into(l, *x, hidden, views_[l], false);
+        x = &views_[l];
     }
+    Matrix<T> &out = views_.back();
+    for (size_t i = 0; i < n; ++i)
+        softmax_row(out.row(i), out.row(i), out.cols()); // 原地softmax
+    return out;
+}
 
-    // 处理接收到的数据
-    Matrix<float> output(1, 10);
-    for (size_t i = 0; i < 10; ++i)
+template <typename T>
+const Matrix<float> &InferenceSession<T>::to_float(const Matrix<T> &out)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        return out;
+    }
+    else
     {
-        output(0, i) = buffer[i];
+        outputView_ = Matrix<float>::view(output_.data(), out.rows(), out.cols(), output_.stride());
+        for (size_t i = 0; i < out.rows(); ++i)
+            for (size_t j = 0; j < out.cols(); ++j)
+                outputView_.row(i)[j] = static_cast<float>(out.row(i)[j]);
+        return outputView_;
     }
-    printf("Received response from server.\n");
+}
 
-    // 关闭套接字
-    close(clientSocket);
+template <typename T>
+const Matrix<float> &InferenceSession<T>::forward(const Matrix<float> &input)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        return predict(input);
+    }
+    else
+    {
+        if (input.cols() != model_.input_size())
+            throw std::invalid_argument("Input dimension must be Nx" + std::to_string(model_.input_size()));
+        size_t n = input.rows();
+        reserve(n);
+        inputView_ = Matrix<T>::view(input_.data(), n, input.cols(), input_.stride());
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = 0; j < input.cols(); ++j)
+                inputView_.row(i)[j] = static_cast<T>(input.row(i)[j]);
+        return to_float(predict(inputView_));
+    }
+}
 
-    return output;
+template <typename T>
+const Matrix<float> &InferenceSession<T>::reset_input(const float *input, size_t n)
+{
+    if (n != model_.input_size())
+        throw std::invalid_argument("Input dimension must be " + std::to_string(model_.input_size()));
+    if (current_.cols() != n)
+    {
+        // 第一次使用增量推理时分配,之后不再分配
+        current_ = Matrix<T>(1, n);
+        preact_ = Matrix<T>(1, model_.layer_out(0));
+        changed_.reserve(n);
+        delta_.reserve(n);
+        ++allocations_;
+    }
+    for (size_t j = 0; j < n; ++j)
+        current_.row(0)[j] = static_cast<T>(input[j]);
+    model_.layer_into(0, current_, false, preact_, false);
+    drift_ = 0;
+    return finish_delta();
 }
 
-// 包装预测函数
 template <typename T>
-const void model<T>::predict(cv::Mat image) const
+const Matrix<float> &InferenceSession<T>::update_input(const uint32_t *indices, const float *values, size_t k)
 {
+    if (current_.rows() == 0)
+        throw std::logic_error("reset_input must be called before update_input");
+    // 只保留真正变化的元素,同一个下标出现多次时以最后一次为准
+    changed_.clear();
+    delta_.clear();
+    T *x = current_.row(0);
+    for (size_t i = 0; i < k; ++i)
+    {
+        if (indices[i] >= current_.cols())
+            throw std::out_of_range("Input index out of range");
+        T v = static_cast<T>(values[i]);
+        if (v == x[indices[i]])
+            continue;
+        changed_.push_back(indices[i]);
+        delta_.push_back(v - x[indices[i]]);
+        x[indices[i]] = v;
+    }
+    if (changed_.empty())
+        return finish_delta();
+    drift_ += changed_.size();
+    if (drift_ > current_.cols())
+    {
+        model_.layer_into(0, current_, false, preact_, false);
+        drift_ = 0;
+    }
+    else
+        model_.layer_update(0, changed_.data(), delta_.data(), changed_.size(), preact_.row(0));
+    return finish_delta();
+}
 
-    // 转换为灰度图像
-    cv::Mat grayImage;
-    cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
+template <typename T>
+const Matrix<float> &InferenceSession<T>::finish_delta()
+{
+    size_t cols = preact_.cols();
+    views_[0] = Matrix<T>::view(buffers_[0].data(), 1, cols, cols);
+    const T *p = preact_.row(0);
+    T *h = views_[0].row(0);
+    if (model_.layers() > 1)
+        for (size_t j = 0; j < cols; ++j)
+            h[j] = std::max(p[j], static_cast<T>(0)); // ReLU
+    else
+        std::copy(p, p + cols, h);
+    return to_float(run_layers(1, views_[0], 1));
+}
 
-    // 图像缩放
-    cv::Mat resized_down;
-    int down_width = 28;
-    int down_height = 28;
-    cv::resize(grayImage, resized_down, cv::Size(down_width, down_height), cv::INTER_LINEAR);
+template <typename T>
+std::unique_ptr<InferenceSessionBase> model<T>::make_session(size_t maxBatch) const
+{
+    return std::make_unique<InferenceSession<T>>(*this, maxBatch);
+}
 
-    // 转换为Matrix<T>
-    Matrix<T> input(1, 784);
-    for (int i = 0; i < down_height; i++)
+// 把一行输入发给服务端: 服务端在本机时优先走共享内存,其次AF_UNIX套接字,最后TCP
+// 每个线程一个共享内存通道和一个长连接,多次预测复用,不再每次都建立和关闭连接
+template <typename In>
+inline void remote_predict(const In *input, float *output)
+{
+    thread_local ShmClient shm;
+    if (shm.attached() || shm.attach())
     {
-        for (int j = 0; j < down_width; j++)
+        // 只有请求没有送到服务端时才改用套接字,否则同一个请求会被计算两次
+        switch (shm.predict(input, output))
         {
-            input(0, i * down_width + j) = resized_down.at<uchar>(i, j) / static_cast<T>(255.0); // 归一化到0~1
+        case ShmClient::SHM_OK:
+            return;
+        case ShmClient::SHM_FAILED:
+            throw std::runtime_error("Server failed to run the prediction");
+        case ShmClient::SHM_TIMEOUT:
+            throw std::runtime_error("Prediction request to server timed out");
+        case ShmClient::SHM_UNAVAILABLE:
+            break;
         }
     }
+    thread_local InferenceClient client(SERVER_IP, SERVER_PORT, SERVER_UNIX_PATH);
+    if (!client.predict(input, output))
+        throw std::runtime_error("Prediction request to server failed");
+}
+
+// 预测函数(有socket通信)
+template <typename T>
+Matrix<float> model<T>::socket_predict(const Matrix<float> &input) const
+{
+
+    if (input.rows() != 1 || input.cols() != INPUT_FLOATS)
+    {
+        throw std::invalid_argument("Input dimension must be 1x784");
+    }
+
+    Matrix<float> output(1, OUTPUT_FLOATS);
+    remote_predict(input.row(0), output.row(0));
+    return output;
+}
+
+template <typename T>
+Matrix<float> model<T>::socket_predict(const uint8_t *pixels) const
+{
+    Matrix<float> output(1, OUTPUT_FLOATS);
+    remote_predict(pixels, output.row(0));
+    return output;
+}
+
+// 包装预测函数
+template <typename T>
+const void model<T>::predict(cv::Mat image) const
+{
+
+    // 预处理为28x28的原始像素,以uint8发送,由服务端归一化
+    uint8_t pixels[INPUT_FLOATS];
+    preprocess_pixels(image, pixels);
 
     // auto start = std::chrono::high_resolution_clock::now(); // 记录开始时间
 
-    // Matrix<T> output = _predict(input);
-    Matrix<float> output = socket_predict(input);
+    // Matrix<T> output = _predict(preprocess(image));
+    Matrix<float> output = socket_predict(pixels);
 
     // auto end = std::chrono::high_resolution_clock::now();                                          // 记录结束时间
     // auto duration_us = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count(); // 计算时间差，单位为毫秒
     // std::cout << "计算用时: " << duration_us << " 毫秒" << std::endl;
 
-    drawBarChart(std::vector<T>{
+    drawBarChart(std::vector<float>{
                      output(0, 0), output(0, 1), output(0, 2), output(0, 3), output(0, 4),
                      output(0, 5), output(0, 6), output(0, 7), output(0, 8), output(0, 9)},
                  "predict", 800, 600);
 }
 
+// 图像预处理
+inline Matrix<float> preprocess(const cv::Mat &image)
+{
+    Matrix<float> input(1, 784);
+    preprocess_into(image, input.row(0)); // 归一化到0~1
+    return input;
+}
+
+inline void preprocess_into(const cv::Mat &image, float *dst, float scale)
+{
+    if (image.depth() != CV_8U || image.channels() == 2 || image.channels() > 4 || image.empty())
+        throw std::invalid_argument("Image must be a non-empty 8-bit grayscale, BGR or BGRA image");
+    thread_local std::vector<float> scratch;
+    size_t width = (size_t)image.cols * image.channels();
+    if (scratch.size() < width)
+        scratch.resize(width);
+    gray_area_resize(image.data, image.rows, image.cols, image.step, image.channels(), dst, 28, 28, 28, scale,
+                     scratch.data());
+}
+
+inline cv::Rect preprocess_region(const cv::Mat &image, const cv::Rect &dirty, float *dst, float scale)
+{
+    if (image.depth() != CV_8U || image.channels() == 2 || image.channels() > 4 || image.empty())
+        throw std::invalid_argument("Image must be a non-empty 8-bit grayscale, BGR or BGRA image");
+    cv::Rect r = dirty & cv::Rect(0, 0, image.cols, image.rows);
+    if (r.empty())
+        return cv::Rect();
+    // 与源区域有重叠的格子
+    float sy = (float)image.rows / 28, sx = (float)image.cols / 28;
+    size_t oy0 = (size_t)(r.y / sy), oy1 = std::min<size_t>(28, (size_t)std::ceil((r.y + r.height) / sy));
+    size_t ox0 = (size_t)(r.x / sx), ox1 = std::min<size_t>(28, (size_t)std::ceil((r.x + r.width) / sx));
+    thread_local std::vector<float> scratch;
+    size_t width = (size_t)image.cols * image.channels();
+    if (scratch.size() < width)
+        scratch.resize(width);
+    gray_area_resize_cells(image.data, image.rows, image.cols, image.step, image.channels(), dst, 28, 28, 28, scale,
+                           scratch.data(), oy0, oy1, ox0, ox1);
+    return cv::Rect((int)ox0, (int)oy0, (int)(ox1 - ox0), (int)(oy1 - oy0));
+}
+
+inline void preprocess_batch(const cv::Mat *images, size_t n, Matrix<float> &out)
+{
+    if (out.rows() != n || out.cols() != 784)
+        throw std::invalid_argument("Output must be " + std::to_string(n) + "x784");
+    ThreadPool::instance().parallel_for(0, n, 1, [&](size_t b0, size_t b1)
+                                        {
+                                            for (size_t i = b0; i < b1; ++i)
+                                                preprocess_into(images[i], out.row(i)); });
+}
+
+inline void preprocess_pixels(const cv::Mat &image, uint8_t *pixels)
+{
+    float gray[784];
+    preprocess_into(image, gray, 1.0f);
+    for (size_t i = 0; i < 784; ++i)
+        pixels[i] = (uint8_t)std::min(255.0f, gray[i] + 0.5f); // 四舍五入
+}
+
 // 绘制柱状图函数
-template <typename T>
-void model<T>::drawBarChart(const std::vector<T> &values, const std::string &windowName, int displayWidth, int displayHeight) const
+inline void modelbase::drawBarChart(const std::vector<float> &values, const std::string &windowName, int displayWidth, int displayHeight) const
 {
     // 参数检查
     if (values.size() != 10)
@@ -450,8 +1167,8 @@ void model<T>::drawBarChart(const std::vector<T> &values, const std::string &win
     // 3. 查找向量中的最大值（用于缩放柱条高度）
     float maxValue = *std::max_element(values.begin(), values.end());
     // 如果最大值为0，避免除以0，并设置一个最小缩放
-    if (maxValue == static_cast<T>(0))
-        maxValue = static_cast<T>(1);
+    if (maxValue == 0.0f)
+        maxValue = 1.0f;
 
     // 4. 绘制每个柱条和标签
     for (int i = 0; i < numBars; ++i)
@@ -0,0 +1,200 @@
+#pragma once
+#include <cctype>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// 权重文件的存储类型
+enum class DType
+{
+    FP32,
+    FP64,
+};
+
+inline size_t dtype_size(DType t)
+{
+    switch (t)
+    {
+    case DType::FP32:
+        return 4;
+    case DType::FP64:
+        return 8;
+    }
+    return 0;
+}
+
+inline DType parse_dtype(const std::string &name)
+{
+    if (name == "fp32")
+        return DType::FP32;
+    if (name == "fp64")
+        return DType::FP64;
+    throw std::runtime_error("Unsupported dtype in meta.json: " + name);
+}
+
+// 一层全连接: weight为in x out, bias为1 x out
+struct LayerMeta
+{
+    std::string name; // 例如"fc1"
+    size_t in = 0;
+    size_t out = 0;
+};
+
+// meta.json的内容: 每个张量的形状和整体的存储类型
+// 层按照在文件中出现的顺序排列,"fcN.weight"和"fcN.bias"属于同一层
+struct ModelMeta
+{
+    DType dtype = DType::FP32;
+    std::vector<LayerMeta> layers;
+
+    static ModelMeta load(const std::string &path);
+    static ModelMeta parse(const std::string &text);
+};
+
+namespace meta_detail
+{
+    // 只支持meta.json用到的JSON子集: 对象,数组,字符串,非负整数
+    struct Parser
+    {
+        const std::string &s;
+        size_t pos = 0;
+
+        void skip()
+        {
+            while (pos < s.size() && std::isspace(static_cast<unsigned char>(s[pos])))
+                ++pos;
+        }
+        void expect(char c)
+        {
+            skip();
+            if (pos >= s.size() || s[pos] != c)
+                throw std::runtime_error(std::string("meta.json: expected '") + c + "' at offset " + std::to_string(pos));
+            ++pos;
+        }
+        bool peek(char c)
+        {
+            skip();
+            return pos < s.size() && s[pos] == c;
+        }
+        std::string string_value()
+        {
+            expect('"');
+            size_t end = s.find('"', pos);
+            if (end == std::string::npos)
+                throw std::runtime_error("meta.json: unterminated string");
+            std::string v = s.substr(pos, end - pos);
+            pos = end + 1;
+            return v;
+        }
+        size_t number()
+        {
+            skip();
+            size_t start = pos, v = 0;
+            while (pos < s.size() && std::isdigit(static_cast<unsigned char>(s[pos])))
+                v = v * 10 + (s[pos++] - '0');
+            if (pos == start)
+                throw std::runtime_error("meta.json: expected number at offset " + std::to_string(pos));
+            return v;
+        }
+        std::vector<size_t> shape()
+        {
+            std::vector<size_t> dims;
+            expect('[');
+            if (!peek(']'))
+            {
+                do
+                    dims.push_back(number());
+                while (peek(',') && (++pos, true));
+            }
+            expect(']');
+            return dims;
+        }
+    };
+}
+
+inline ModelMeta ModelMeta::parse(const std::string &text)
+{
+    meta_detail::Parser p{text};
+    ModelMeta meta;
+    std::vector<std::pair<std::string, std::vector<size_t>>> tensors;
+
+    p.expect('{');
+    if (!p.peek('}'))
+    {
+        do
+        {
+            std::string key = p.string_value();
+            p.expect(':');
+            if (key == "type")
+                meta.dtype = parse_dtype(p.string_value());
+            else
+                tensors.emplace_back(key, p.shape());
+        } while (p.peek(',') && (++p.pos, true));
+    }
+    p.expect('}');
+
+    // 按出现顺序收集层名
+    for (const auto &[key, dims] : tensors)
+    {
+        size_t dot = key.rfind('.');
+        if (dot == std::string::npos)
+            throw std::runtime_error("meta.json: tensor name without '.': " + key);
+        std::string layer = key.substr(0, dot), kind = key.substr(dot + 1);
+        if (dims.size() != 2)
+            throw std::runtime_error("meta.json: tensor " + key + " must be 2-D");
+
+        LayerMeta *l = nullptr;
+        for (auto &x : meta.layers)
+            if (x.name == layer)
+                l = &x;
+        if (!l)
+        {
+            meta.layers.push_back(LayerMeta{layer});
+            l = &meta.layers.back();
+        }
+        if (kind == "weight")
+        {
+            l->in = dims[0];
+            l->out = dims[1];
+        }
+        else if (kind != "bias")
+            throw std::runtime_error("meta.json: unknown tensor kind: " + key);
+    }
+
+    // 检查每层都有weight和bias,且相邻层的维度首尾相接
+    for (size_t i = 0; i < meta.layers.size(); ++i)
+    {
+        const LayerMeta &l = meta.layers[i];
+        bool hasBias = false;
+        for (const auto &[key, dims] : tensors)
+            if (key == l.name + ".bias")
+            {
+                hasBias = true;
+                if (dims[0] != 1 || dims[1] != l.out)
+                    throw std::runtime_error("meta.json: bias shape mismatch for " + l.name);
+            }
+        if (l.in == 0 || l.out == 0 || !hasBias)
+            throw std::runtime_error("meta.json: layer " + l.name + " needs both weight and bias");
+        if (i > 0 && meta.layers[i - 1].out != l.in)
+            throw std::runtime_error("meta.json: layer " + l.name + " input does not match previous layer output");
+    }
+    if (meta.layers.empty())
+        throw std::runtime_error("meta.json: no layers");
+    return meta;
+}
+
+inline ModelMeta ModelMeta::load(const std::string &path)
+{
+    FILE *pf = fopen(path.c_str(), "rb");
+    if (!pf)
+        throw std::runtime_error("Cannot open " + path);
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), pf)) > 0)
+        text.append(buf, n);
+    fclose(pf);
+    return parse(text);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// 有界无锁多生产者多消费者队列(Vyukov环形队列)
+// 每个格子有一个序号: 等于位置时可写,等于位置+1时可读; 生产者和消费者各自用CAS推进tail_/head_,
+// 不同位置上的读写互不干扰,满和空时立即返回false,由调用者决定等待方式.
+template <typename T>
+class MpmcQueue
+{
+public:
+    // 容量向上取整到2的幂
+    explicit MpmcQueue(size_t capacity);
+
+    bool try_push(const T &value);
+    bool try_pop(T &value);
+    size_t capacity() const { return mask_ + 1; }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+private:
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> tail_{0}; // 下一个写入位置
+    alignas(64) std::atomic<size_t> head_{0}; // 下一个读取位置
+};
+
+template <typename T>
+MpmcQueue<T>::MpmcQueue(size_t capacity)
+{
+    size_t n = 2;
+    while (n < capacity)
+        n <<= 1;
+    mask_ = n - 1;
+    cells_.reset(new Cell[n]);
+    for (size_t i = 0; i < n; ++i)
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template <typename T>
+bool MpmcQueue<T>::try_push(const T &value)
+{
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Cell &cell = cells_[pos & mask_];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.value = value;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) // 这个格子还没被读走: 队列满
+            return false;
+        else
+            pos = tail_.load(std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+bool MpmcQueue<T>::try_pop(T &value)
+{
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Cell &cell = cells_[pos & mask_];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                value = cell.value;
+                cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) // 这个格子还没写入: 队列空
+            return false;
+        else
+            pos = head_.load(std::memory_order_relaxed);
+    }
+}
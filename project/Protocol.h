@@ -0,0 +1,68 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 客户端和服务端之间的二进制协议,按主机字节序传输(两端都是x86)
+// 每个消息是一个帧: 固定长度的头 + length字节的数据,读写都要循环到整帧收发完为止
+//   请求: RequestHeader + batch行输入,每行INPUT_FLOATS个元素,元素类型由dtype决定
+//   响应: ResponseHeader + (status为OK时)batch行输出,每行OUTPUT_FLOATS个float
+// 一个连接上可以连续发送多个请求而不必等待响应,响应通过id与请求对应
+
+#define SERVER_UNIX_PATH "/tmp/gkd-infer.sock" // 同一台机器上的客户端使用的AF_UNIX套接字
+#define PROTOCOL_MAGIC 0x4E464B47u // "GKFN"
+#define PROTOCOL_VERSION 2
+#define PROTOCOL_MAX_PAYLOAD (64u << 20) // 单个请求数据的上限,超过视为协议错误
+
+#define INPUT_FLOATS 784 // 28x28灰度图,每行的元素个数
+#define OUTPUT_FLOATS 10 // 10个类别的概率
+
+// 请求数据的元素类型
+enum PayloadType : uint8_t
+{
+    PAYLOAD_FP32 = 0, // float,已经归一化
+    PAYLOAD_U8 = 1,   // 0~255的原始像素,服务端在装入批次时除以255,数据量只有float的1/4
+};
+
+// 响应状态
+enum ResponseStatus : uint16_t
+{
+    STATUS_OK = 0,
+    STATUS_INFERENCE_FAILED = 1, // 推理出错
+    STATUS_BAD_REQUEST = 2,      // 版本,类型,模型或长度不对,请求被丢弃
+};
+
+struct RequestHeader
+{
+    uint32_t magic;   // PROTOCOL_MAGIC
+    uint16_t version; // PROTOCOL_VERSION
+    uint8_t dtype;    // PayloadType
+    uint8_t model;    // 模型编号,目前服务端只有0号模型
+    uint32_t id;      // 客户端分配,服务端原样返回
+    uint32_t batch;   // 输入的行数
+    uint32_t length;  // 头后面的数据字节数
+};
+
+struct ResponseHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t status; // ResponseStatus
+    uint32_t id;
+    uint32_t batch;
+    uint32_t length;
+};
+
+static_assert(sizeof(RequestHeader) == 20 && sizeof(ResponseHeader) == 20, "protocol headers must not be padded");
+
+// 一个元素的字节数,不支持的类型返回0
+inline size_t payload_element_size(uint8_t dtype)
+{
+    switch (dtype)
+    {
+    case PAYLOAD_FP32:
+        return sizeof(float);
+    case PAYLOAD_U8:
+        return sizeof(uint8_t);
+    }
+    return 0;
+}
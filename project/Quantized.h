@@ -0,0 +1,223 @@
+#pragma once
+#include "Matrix.h"
+
+// INT8量化推理
+// 离线量化(quantize_model)在模型目录下为每层写出:
+//   <层名>.weight.int8  in x out行优先的int8权重
+//   <层名>.weight.scale out个float,每个输出通道的scale(权重 ≈ int8值 * scale)
+// model_int8加载这些文件,偏置仍使用原来的<层名>.bias.
+
+// 一层量化后的全连接层
+struct Int8Layer
+{
+    size_t in = 0, out = 0;
+    std::vector<int8_t> packed; // pack_int8_weights打包后的权重
+    std::vector<float> scale;   // 每个输出通道的scale
+    Matrix<float> bias{0, 0};   // 1 x out
+};
+
+// 单行推理需要的临时缓冲区
+struct Int8Scratch
+{
+    std::vector<uint8_t> q;   // 量化后的激活
+    std::vector<int32_t> acc; // int32累加结果
+    std::vector<float> a, b;  // 隐藏层激活,两层之间交替使用
+};
+
+// 离线量化: 对每层权重按输出通道取max|w|/127作为scale,结果写到模型目录下
+// 返回各层量化误差的最大值(按原权重的绝对误差)
+inline float quantize_model(const string &dir)
+{
+    ModelMeta meta = ModelMeta::load(dir + "/meta.json");
+    model<float> m(dir); // fp64的权重在这里转换成float
+    float maxErr = 0.0f;
+    for (size_t l = 0; l < m.layers(); ++l)
+    {
+        const Matrix<float> &W = m.weight(l);
+        size_t in = W.rows(), out = W.cols();
+        std::vector<float> scale(out, 0.0f);
+        for (size_t p = 0; p < in; ++p)
+            for (size_t j = 0; j < out; ++j)
+                scale[j] = std::max(scale[j], std::abs(W.row(p)[j]));
+        for (float &s : scale)
+            s = s > 0.0f ? s / 127.0f : 1.0f;
+
+        std::vector<int8_t> q(in * out);
+        for (size_t p = 0; p < in; ++p)
+            for (size_t j = 0; j < out; ++j)
+            {
+                float v = std::round(W.row(p)[j] / scale[j]);
+                q[p * out + j] = static_cast<int8_t>(std::clamp(v, -127.0f, 127.0f));
+                maxErr = std::max(maxErr, std::abs(q[p * out + j] * scale[j] - W.row(p)[j]));
+            }
+
+        string base = dir + "/" + meta.layers[l].name + ".weight";
+        FILE *pf = fopen((base + ".int8").c_str(), "wb");
+        if (!pf)
+            throw std::runtime_error("Cannot write " + base + ".int8");
+        fwrite(q.data(), 1, q.size(), pf);
+        fclose(pf);
+        pf = fopen((base + ".scale").c_str(), "wb");
+        if (!pf)
+            throw std::runtime_error("Cannot write " + base + ".scale");
+        fwrite(scale.data(), sizeof(float), scale.size(), pf);
+        fclose(pf);
+    }
+    return maxErr;
+}
+
+// INT8模型: 权重为int8,激活按行动态量化为uint8,int32累加后再乘两个scale还原成float
+// 要求每层输入非负(像素和ReLU输出),负数会被截断为0
+class model_int8 : public modelbase
+{
+private:
+    std::vector<Int8Layer> layers_;
+
+public:
+    model_int8(const string &path = "");
+    virtual const void predict(cv::Mat image) const;
+    virtual Matrix<float> forward(const Matrix<float> &input) const;
+    virtual size_t input_size() const { return layers_.front().in; }
+    virtual size_t output_size() const { return layers_.back().out; }
+    virtual std::unique_ptr<InferenceSessionBase> make_session(size_t maxBatch = 1) const;
+    size_t layers() const { return layers_.size(); }
+
+    // 对一行输入做完整的前向计算,out长度为output_size()
+    void forward_row(const float *x, float *out, Int8Scratch &scratch) const;
+    // 按各层的最大宽度准备临时缓冲区
+    void prepare(Int8Scratch &scratch) const;
+};
+
+inline model_int8::model_int8(const string &path)
+    : modelbase(path)
+{
+    ModelMeta meta = ModelMeta::load(_path + "/meta.json");
+    for (const LayerMeta &lm : meta.layers)
+    {
+        string base = _path + "/" + lm.name;
+        auto wfile = MappedFile::open(base + ".weight.int8");
+        auto sfile = MappedFile::open(base + ".weight.scale");
+        auto bfile = MappedFile::open(base + ".bias");
+        if (!wfile || !sfile)
+            throw std::runtime_error("Missing int8 weights for " + base + ", run quantize first");
+        if (!bfile)
+            throw std::runtime_error("Cannot map weight file " + base + ".bias");
+        if (wfile->size() < lm.in * lm.out || sfile->size() < lm.out * sizeof(float) ||
+            bfile->size() < lm.out * dtype_size(meta.dtype))
+            throw std::runtime_error("Weight file too small: " + base);
+
+        Int8Layer layer;
+        layer.in = lm.in;
+        layer.out = lm.out;
+        layer.packed.resize(int8_padded_k(lm.in) * lm.out);
+        pack_int8_weights(static_cast<const int8_t *>(wfile->data()), lm.in, lm.out, layer.packed.data());
+        const float *s = static_cast<const float *>(sfile->data());
+        layer.scale.assign(s, s + lm.out);
+        layer.bias = meta.dtype == DType::FP64 ? weight_from_file<float, double>(bfile, 1, lm.out)
+                                               : weight_from_file<float, float>(bfile, 1, lm.out);
+        layers_.push_back(std::move(layer));
+    }
+}
+
+inline void model_int8::prepare(Int8Scratch &scratch) const
+{
+    size_t maxIn = 0, maxOut = 0;
+    for (const Int8Layer &l : layers_)
+    {
+        maxIn = std::max(maxIn, int8_padded_k(l.in));
+        maxOut = std::max(maxOut, l.out);
+    }
+    scratch.q.assign(maxIn, 0);
+    scratch.acc.resize(maxOut);
+    scratch.a.resize(maxOut);
+    scratch.b.resize(maxOut);
+}
+
+inline void model_int8::forward_row(const float *x, float *out, Int8Scratch &scratch) const
+{
+    const float *cur = x;
+    for (size_t l = 0; l < layers_.size(); ++l)
+    {
+        const Int8Layer &layer = layers_[l];
+        // 动态量化本层输入: 0~max映射到0~127
+        float mx = 0.0f;
+        for (size_t p = 0; p < layer.in; ++p)
+            mx = std::max(mx, cur[p]);
+        float sx = mx / 127.0f, inv = mx > 0.0f ? 127.0f / mx : 0.0f;
+        for (size_t p = 0; p < layer.in; ++p)
+            scratch.q[p] = static_cast<uint8_t>(std::min(127.0f, std::max(0.0f, cur[p] * inv) + 0.5f));
+        for (size_t p = layer.in; p < int8_padded_k(layer.in); ++p)
+            scratch.q[p] = 0;
+
+        gemv_int8(scratch.q.data(), layer.packed.data(), int8_padded_k(layer.in), layer.out, scratch.acc.data());
+
+        bool hidden = l + 1 < layers_.size();
+        float *dst = !hidden ? out : (l % 2 == 0 ? scratch.a.data() : scratch.b.data());
+        const float *b = layer.bias.row(0);
+        for (size_t j = 0; j < layer.out; ++j)
+        {
+            float v = scratch.acc[j] * sx * layer.scale[j] + b[j];
+            dst[j] = hidden ? std::max(v, 0.0f) : v;
+        }
+        cur = dst;
+    }
+    softmax_row(out, out, layers_.back().out);
+}
+
+inline Matrix<float> model_int8::forward(const Matrix<float> &input) const
+{
+    if (input.cols() != input_size())
+        throw std::invalid_argument("Input dimension must be Nx" + std::to_string(input_size()));
+    Int8Scratch scratch;
+    prepare(scratch);
+    Matrix<float> result(input.rows(), output_size());
+    for (size_t i = 0; i < input.rows(); ++i)
+        forward_row(input.row(i), result.row(i), scratch);
+    return result;
+}
+
+// INT8推理会话: 临时缓冲区和输出矩阵都预先分配
+class Int8Session : public InferenceSessionBase
+{
+public:
+    Int8Session(const model_int8 &m, size_t maxBatch)
+        : model_(m), output_(std::max<size_t>(1, maxBatch), m.output_size())
+    {
+        m.prepare(scratch_);
+    }
+
+    virtual const Matrix<float> &forward(const Matrix<float> &input)
+    {
+        if (input.cols() != model_.input_size())
+            throw std::invalid_argument("Input dimension must be Nx" + std::to_string(model_.input_size()));
+        if (input.rows() > output_.rows())
+        {
+            output_ = Matrix<float>(input.rows(), model_.output_size());
+            ++allocations_;
+        }
+        view_ = Matrix<float>::view(output_.data(), input.rows(), output_.cols(), output_.stride());
+        for (size_t i = 0; i < input.rows(); ++i)
+            model_.forward_row(input.row(i), view_.row(i), scratch_);
+        return view_;
+    }
+    virtual size_t allocations() const { return allocations_; }
+
+private:
+    const model_int8 &model_;
+    Int8Scratch scratch_;
+    Matrix<float> output_;
+    Matrix<float> view_{0, 0};
+    size_t allocations_ = 1;
+};
+
+inline std::unique_ptr<InferenceSessionBase> model_int8::make_session(size_t maxBatch) const
+{
+    return std::make_unique<Int8Session>(*this, maxBatch);
+}
+
+// 本地用int8模型预测并画出结果
+inline const void model_int8::predict(cv::Mat image) const
+{
+    Matrix<float> output = forward(preprocess(image));
+    drawBarChart(std::vector<float>(output.row(0), output.row(0) + output.cols()), "predict", 800, 600);
+}
@@ -0,0 +1,471 @@
+#pragma once
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 边沿触发的epoll事件循环
+// 一个线程处理所有连接: 监听套接字上循环accept,每个连接有自己的读写缓冲区,读写都做到EAGAIN为止.
+// 收到的字节交给DataHandler解析,解析出的请求由调用者交给推理线程;
+// 推理线程用reply()把响应放进完成队列并通过eventfd唤醒事件循环,由事件循环写回连接.
+// 连接用递增的id标识而不是fd,连接关闭后迟到的响应按id查不到,直接丢弃.
+// 背压: 推理队列满(DataHandler调用pause)或者待发送的字节超过高水位时,暂停读取这个连接(从epoll中去掉EPOLLIN),
+// 对端的数据留在内核缓冲区里,由TCP流控挡住对端; 高水位持续太久说明对端不读响应,关闭连接.
+// 对端只关闭写方向(shutdown(SHUT_WR))时停止读取,等还在计算的请求都写回之后再关闭.
+class Reactor
+{
+public:
+    // 连接上有新数据时调用: data为缓冲区中尚未处理的全部字节,返回处理掉的字节数,不完整的请求留到下次
+    // 返回值大于len表示协议错误,连接会被关闭
+    // 每个交给推理线程的请求先调用expect_reply,之后必须恰好有一次reply
+    using DataHandler = std::function<size_t(uint64_t conn, const char *data, size_t len)>;
+    // 连接关闭时在事件循环线程调用
+    using CloseHandler = std::function<void(uint64_t conn)>;
+
+    explicit Reactor(DataHandler onData);
+    ~Reactor();
+
+    // 由事件循环接受fd上的连接,fd会被设成非阻塞
+    void listen_on(int fd);
+    // 监视其他fd(signalfd, eventfd等),可读时在事件循环线程调用onReadable
+    void watch(int fd, std::function<void()> onReadable);
+    void on_close(CloseHandler onClose) { onClose_ = std::move(onClose); }
+    // 把响应追加到连接的写缓冲区,可以在任意线程调用
+    void reply(uint64_t conn, const void *data, size_t len);
+    // 以下由DataHandler在事件循环线程调用
+    // 记下conn上有一个请求等待响应,对端半关闭后要等它写回才关闭连接
+    void expect_reply(uint64_t conn);
+    // 推理队列满,暂停读取conn; DataHandler返回的字节数之后的数据在resume_paused之后重新交给它
+    void pause(uint64_t conn);
+    // 推理队列有空位了,重新处理所有被pause的连接,可以在任意线程调用
+    void resume_paused();
+    // 运行事件循环,直到stop()
+    void run();
+    void stop();
+    size_t connections() const { return connections_.size(); }
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+private:
+    // 待发送的字节超过高水位时暂停读取,降到低水位以下恢复; 超过高水位的时间超过上限时关闭连接
+    static constexpr size_t OUTPUT_HIGH_WATER = 4u << 20;
+    static constexpr size_t OUTPUT_LOW_WATER = 1u << 20;
+    static constexpr std::chrono::seconds OUTPUT_STALL_LIMIT{10};
+
+    struct Connection
+    {
+        int fd = -1;
+        std::vector<char> in;    // 已收到但还没解析的字节
+        std::vector<char> out;   // 待发送的字节
+        size_t sent = 0;         // out中已经发送的字节数
+        size_t inflight = 0;     // 已经交给推理线程,响应还没有写进out的请求数
+        bool waitSlots = false;  // 推理队列满,等resume_paused
+        bool outputFull = false; // out超过高水位,等对端读走
+        bool readClosed = false; // 对端已经关闭写方向
+        bool reading = true;     // epoll中是否注册了EPOLLIN
+        std::chrono::steady_clock::time_point fullSince; // outputFull开始的时间
+    };
+    struct Completion
+    {
+        uint64_t conn;
+        std::vector<char> data;
+    };
+
+    void add(int fd, uint64_t id, uint32_t events);
+    void accept_all(int listenFd);
+    void on_readable(uint64_t id, Connection &c);
+    // 把in中的数据交给DataHandler,协议错误时关闭连接并返回false
+    bool process(uint64_t id, Connection &c);
+    // 按连接的状态更新读取和高水位,该关闭时关闭; 关闭了返回false
+    bool settle(uint64_t id, Connection &c);
+    bool flush(Connection &c); // 写到EAGAIN或写完,出错返回false
+    void close_connection(uint64_t id);
+    void drain_completions();
+    void retry_paused();
+    void close_stalled();
+
+    DataHandler onData_;
+    CloseHandler onClose_;
+    int epollFd_ = -1;
+    int wakeFd_ = -1; // eventfd,完成队列非空或stop时写入
+    uint64_t nextId_ = 1;
+    bool stop_ = false;
+    std::unordered_map<uint64_t, Connection> connections_;
+    std::unordered_map<uint64_t, std::function<void()>> sources_; // 监听套接字和watch的fd
+    size_t fullCount_ = 0; // outputFull的连接数,不为0时事件循环定时检查是否超时
+
+    std::atomic<bool> resume_{false}; // resume_paused请求过,事件循环被唤醒时处理
+
+    std::mutex m_;
+    std::vector<Completion> completions_; // 推理线程交回的响应,由事件循环取走
+};
+
+inline Reactor::Reactor(DataHandler onData) : onData_(std::move(onData))
+{
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd_ == -1 || wakeFd_ == -1)
+        throw std::runtime_error(std::string("Failed to create epoll: ") + strerror(errno));
+    watch(wakeFd_, [this]()
+          {
+              uint64_t v;
+              while (read(wakeFd_, &v, sizeof(v)) > 0)
+                  ;
+              drain_completions();
+              if (resume_.exchange(false))
+                  retry_paused(); });
+}
+
+inline Reactor::~Reactor()
+{
+    for (auto &[id, c] : connections_)
+        close(c.fd);
+    close(wakeFd_);
+    close(epollFd_);
+}
+
+inline void Reactor::add(int fd, uint64_t id, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = id;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+        throw std::runtime_error(std::string("epoll_ctl failed: ") + strerror(errno));
+}
+
+inline void Reactor::listen_on(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    uint64_t id = nextId_++;
+    sources_[id] = [this, fd]()
+    { accept_all(fd); };
+    add(fd, id, EPOLLIN | EPOLLET);
+}
+
+inline void Reactor::watch(int fd, std::function<void()> onReadable)
+{
+    uint64_t id = nextId_++;
+    sources_[id] = std::move(onReadable);
+    add(fd, id, EPOLLIN | EPOLLET);
+}
+
+inline void Reactor::reply(uint64_t conn, const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        wasEmpty = completions_.empty();
+        completions_.push_back(Completion{conn, std::vector<char>(p, p + len)});
+    }
+    // 队列原来非空说明已经唤醒过,事件循环会一并取走
+    if (wasEmpty)
+    {
+        uint64_t one = 1;
+        if (write(wakeFd_, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("Failed to wake event loop");
+    }
+}
+
+inline void Reactor::expect_reply(uint64_t conn)
+{
+    auto it = connections_.find(conn);
+    if (it != connections_.end())
+        ++it->second.inflight;
+}
+
+inline void Reactor::pause(uint64_t conn)
+{
+    auto it = connections_.find(conn);
+    if (it != connections_.end())
+        it->second.waitSlots = true;
+}
+
+inline void Reactor::resume_paused()
+{
+    resume_.store(true);
+    uint64_t one = 1;
+    if (write(wakeFd_, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("Failed to wake event loop");
+}
+
+inline void Reactor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
+    }
+    uint64_t one = 1;
+    if (write(wakeFd_, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("Failed to wake event loop");
+}
+
+inline void Reactor::run()
+{
+    struct epoll_event events[256];
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if (stop_)
+                return;
+        }
+        // 有连接超过输出高水位时每秒醒来一次,检查它是否已经超时
+        int n = epoll_wait(epollFd_, events, 256, fullCount_ > 0 ? 1000 : -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            uint64_t id = events[i].data.u64;
+            auto src = sources_.find(id);
+            if (src != sources_.end())
+            {
+                src->second();
+                continue;
+            }
+            auto it = connections_.find(id);
+            if (it == connections_.end()) // 同一批事件里已经被关闭
+                continue;
+            Connection &c = it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(id);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                if (!flush(c))
+                {
+                    close_connection(id);
+                    continue;
+                }
+                if (!settle(id, c))
+                    continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                on_readable(id, c);
+        }
+        if (fullCount_ > 0)
+            close_stalled();
+    }
+}
+
+inline void Reactor::accept_all(int listenFd)
+{
+    while (true)
+    {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept client connection");
+            return;
+        }
+        // 响应都是小包,关掉Nagle,否则流水线请求的响应会被延迟ACK拖住
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        uint64_t id = nextId_++;
+        connections_[id].fd = fd;
+        add(fd, id, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+inline void Reactor::on_readable(uint64_t id, Connection &c)
+{
+    if (!c.reading) // 同一批事件里刚刚暂停了读取
+        return;
+    bool eof = false;
+    char buf[16384];
+    while (true)
+    {
+        ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+        if (r > 0)
+        {
+            c.in.insert(c.in.end(), buf, buf + r);
+            continue;
+        }
+        if (r == 0)
+            eof = true;
+        else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            close_connection(id);
+            return;
+        }
+        break;
+    }
+
+    if (!process(id, c))
+        return;
+    // 对端只是不再发送,已经收到的请求照常计算,响应写回后再关闭
+    if (eof)
+        c.readClosed = true;
+    settle(id, c);
+}
+
+inline bool Reactor::process(uint64_t id, Connection &c)
+{
+    // 解析出所有完整的请求,剩下的半个请求(或者推理队列满时还没提交的请求)留在缓冲区
+    c.waitSlots = false;
+    if (!c.in.empty())
+    {
+        size_t used = onData_(id, c.in.data(), c.in.size());
+        if (used > c.in.size())
+        {
+            close_connection(id);
+            return false;
+        }
+        c.in.erase(c.in.begin(), c.in.begin() + used);
+    }
+    return true;
+}
+
+inline bool Reactor::settle(uint64_t id, Connection &c)
+{
+    size_t queued = c.out.size() - c.sent;
+    if (!c.outputFull && queued > OUTPUT_HIGH_WATER)
+    {
+        c.outputFull = true;
+        c.fullSince = std::chrono::steady_clock::now();
+        ++fullCount_;
+    }
+    else if (c.outputFull && queued < OUTPUT_LOW_WATER)
+    {
+        c.outputFull = false;
+        --fullCount_;
+    }
+
+    // 半关闭的连接在所有请求都写回后关闭
+    if (c.readClosed && !c.waitSlots && c.inflight == 0 && queued == 0)
+    {
+        close_connection(id);
+        return false;
+    }
+
+    bool reading = !c.waitSlots && !c.outputFull && !c.readClosed;
+    if (reading != c.reading)
+    {
+        // 重新加上EPOLLIN时如果已经有数据,epoll会立即报告一次,不会错过边沿
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT | EPOLLET | (reading ? EPOLLIN | EPOLLRDHUP : 0);
+        ev.data.u64 = id;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, c.fd, &ev) == -1)
+        {
+            perror("epoll_ctl failed");
+            close_connection(id);
+            return false;
+        }
+        c.reading = reading;
+    }
+    return true;
+}
+
+inline bool Reactor::flush(Connection &c)
+{
+    while (c.sent < c.out.size())
+    {
+        ssize_t w = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (w > 0)
+        {
+            c.sent += w;
+            continue;
+        }
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true; // 等下一次EPOLLOUT
+        return false;
+    }
+    c.out.clear();
+    c.sent = 0;
+    return true;
+}
+
+inline void Reactor::close_connection(uint64_t id)
+{
+    auto it = connections_.find(id);
+    if (it == connections_.end())
+        return;
+    if (it->second.outputFull)
+        --fullCount_;
+    close(it->second.fd); // close会把fd从epoll中移除
+    connections_.erase(it);
+    if (onClose_)
+        onClose_(id);
+}
+
+inline void Reactor::drain_completions()
+{
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        done.swap(completions_);
+    }
+    for (Completion &d : done)
+    {
+        auto it = connections_.find(d.conn);
+        if (it == connections_.end())
+            continue;
+        Connection &c = it->second;
+        if (c.inflight > 0)
+            --c.inflight;
+        c.out.insert(c.out.end(), d.data.begin(), d.data.end());
+        if (!flush(c))
+            close_connection(d.conn);
+        else
+            settle(d.conn, c);
+    }
+}
+
+inline void Reactor::retry_paused()
+{
+    std::vector<uint64_t> paused;
+    for (auto &[id, c] : connections_)
+        if (c.waitSlots)
+            paused.push_back(id);
+    for (uint64_t id : paused)
+    {
+        auto it = connections_.find(id);
+        if (it != connections_.end() && process(id, it->second))
+            settle(id, it->second);
+    }
+}
+
+inline void Reactor::close_stalled()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<uint64_t> stalled;
+    for (auto &[id, c] : connections_)
+        if (c.outputFull && now - c.fullSince > OUTPUT_STALL_LIMIT)
+            stalled.push_back(id);
+    for (uint64_t id : stalled)
+    {
+        fprintf(stderr, "Closing connection %llu: client is not reading responses\n", (unsigned long long)id);
+        close_connection(id);
+    }
+}
@@ -0,0 +1,378 @@
+#pragma once
+#include "Protocol.h"
+#include "Futex.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// 共享内存传输: 与服务端在同一台机器上的客户端不走套接字,请求和结果都放在映射的共享内存里
+// 服务端创建SHM_NAME,里面有SHM_CHANNELS个通道,每个客户端占用一个通道;
+// 每个通道是SHM_SLOTS个槽组成的环,客户端按顺序使用槽,槽的state同时是futex字:
+//   FREE -> (客户端写好输入) REQUEST -> (服务端取走) BUSY -> (服务端写好结果) DONE -> (客户端读走) FREE
+// 客户端只写FREE或DONE的槽,BUSY的槽只有服务端会写; 客户端超时放弃的请求由服务端照常完成,槽变成DONE后再重新使用.
+// 每次发布请求时客户端增加槽的generation,服务端写结果前核对它,并把它写进answered,客户端据此确认结果属于自己的请求.
+// 客户端发布请求后增加doorbell并futex唤醒服务端,服务端写好结果后futex唤醒等待该槽的客户端,
+// 整个往返只有这两次futex系统调用进入内核.
+
+#define SHM_NAME "/gkd-infer"
+#define SHM_MAGIC 0x4D484B47u // "GKHM"
+#define SHM_LAYOUT_VERSION 1 // 共享内存布局的版本,与套接字协议的PROTOCOL_VERSION无关; 布局变化时加1
+#define SHM_CHANNELS 16
+#define SHM_SLOTS 8
+
+enum ShmSlotState : uint32_t
+{
+    SLOT_FREE = 0,
+    SLOT_REQUEST = 1,
+    SLOT_BUSY = 2,
+    SLOT_DONE = 3,
+};
+
+struct alignas(64) ShmSlot
+{
+    std::atomic<uint32_t> state; // ShmSlotState,也是futex字
+    uint32_t dtype;              // PayloadType
+    uint32_t status;             // ResponseStatus
+    std::atomic<uint32_t> generation; // 客户端每发布一个请求加1
+    uint32_t answered;                // 结果对应的请求的generation
+    float output[OUTPUT_FLOATS];
+    union alignas(64)
+    {
+        float input[INPUT_FLOATS];
+        uint8_t pixels[INPUT_FLOATS];
+    };
+};
+
+struct alignas(64) ShmChannel
+{
+    std::atomic<int32_t> owner; // 占用通道的客户端进程号,0为空闲
+    alignas(64) ShmSlot slots[SHM_SLOTS];
+};
+
+struct ShmRegion
+{
+    uint32_t magic;
+    uint32_t version; // SHM_LAYOUT_VERSION
+    int32_t server; // 服务端进程号,服务端异常退出后共享内存还在,客户端据此判断
+    alignas(64) std::atomic<uint32_t> doorbell; // 每发布一个请求加1,服务端在上面futex等待
+    ShmChannel channels[SHM_CHANNELS];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+              "shared memory atomics must be lock-free");
+
+// 服务端: 创建共享内存,一个线程等待doorbell并把请求交给submit,结果由完成回调写回槽中
+class ShmServer
+{
+public:
+    // 把一行输入交给推理,推理完成后调用done(output, n),output为nullptr表示失败
+    // 不能阻塞: 推理队列已满时返回false(done不会被调用),槽留在REQUEST,等notify之后再扫描
+    using Submit = std::function<bool(const ShmSlot &slot, std::function<void(const float *, size_t)> done)>;
+
+    // 共享内存只有mode允许的用户可以映射,默认只有服务端自己的用户; group不为-1时把属组改成它(mode应包含组读写)
+    ShmServer(const char *name, Submit submit, mode_t mode = 0600, gid_t group = (gid_t)-1);
+    ~ShmServer();
+
+    // 推理队列有了空位时调用,唤醒扫描线程重新提交留下的请求; 可以在任意线程调用,不阻塞
+    void notify();
+
+    ShmServer(const ShmServer &) = delete;
+    ShmServer &operator=(const ShmServer &) = delete;
+
+private:
+    void run();
+
+    std::string name_;
+    Submit submit_;
+    std::shared_ptr<ShmRegion> region_; // 完成回调也持有,推理中的请求不会写到已解除的映射上
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+inline ShmServer::ShmServer(const char *name, Submit submit, mode_t mode, gid_t group)
+    : name_(name), submit_(std::move(submit))
+{
+    // 每次启动都新建,旧客户端映射的是已删除的对象,不会和新服务端混在一起
+    // 能映射的用户可以读到其他客户端的输入输出,也能改写槽,所以默认只对自己的用户开放
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+        throw std::runtime_error(std::string("Failed to create shared memory: ") + strerror(errno));
+    if ((group != (gid_t)-1 && fchown(fd, (uid_t)-1, group) == -1) || fchmod(fd, mode) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        throw std::runtime_error(std::string("Failed to set shared memory permissions: ") + strerror(errno));
+    }
+    if (ftruncate(fd, sizeof(ShmRegion)) == -1)
+    {
+        close(fd);
+        throw std::runtime_error(std::string("Failed to size shared memory: ") + strerror(errno));
+    }
+    void *p = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error(std::string("Failed to map shared memory: ") + strerror(errno));
+    ShmRegion *region = new (p) ShmRegion(); // 新建的共享内存全为0,这里只是开始对象的生命周期
+    region->version = SHM_LAYOUT_VERSION;
+    region->server = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    region->magic = SHM_MAGIC;
+    region_ = std::shared_ptr<ShmRegion>(region, [](ShmRegion *r)
+                                         { munmap(r, sizeof(ShmRegion)); });
+    thread_ = std::thread([this]()
+                          { run(); });
+}
+
+inline ShmServer::~ShmServer()
+{
+    stop_ = true;
+    notify();
+    thread_.join();
+    shm_unlink(name_.c_str());
+}
+
+inline void ShmServer::notify()
+{
+    region_->doorbell.fetch_add(1, std::memory_order_release);
+    futex_wake(region_->doorbell);
+}
+
+inline void ShmServer::run()
+{
+    ShmRegion &r = *region_;
+    while (!stop_)
+    {
+        // 先读doorbell再扫描: 扫描之后才发布的请求一定会改变doorbell,futex_wait会立即返回
+        // 队列满时notify也会改变doorbell,所以提交失败后同样可以在doorbell上等待
+        uint32_t seen = r.doorbell.load(std::memory_order_acquire);
+        bool full = false;
+        for (ShmChannel &channel : r.channels)
+        {
+            if (full)
+                break;
+            if (channel.owner.load(std::memory_order_relaxed) == 0)
+                continue;
+            for (ShmSlot &slot : channel.slots)
+            {
+                uint32_t expected = SLOT_REQUEST;
+                if (!slot.state.compare_exchange_strong(expected, SLOT_BUSY, std::memory_order_acquire))
+                    continue;
+                std::shared_ptr<ShmRegion> keep = region_;
+                uint32_t generation = slot.generation.load(std::memory_order_relaxed);
+                bool submitted = submit_(slot, [keep, &slot, generation](const float *output, size_t n)
+                        {
+                            // 槽在BUSY期间客户端不会改动,这里只是防止结果写进别的请求
+                            if (slot.generation.load(std::memory_order_relaxed) != generation)
+                                return;
+                            slot.answered = generation;
+                            if (output && n == OUTPUT_FLOATS)
+                            {
+                                memcpy(slot.output, output, n * sizeof(float));
+                                slot.status = STATUS_OK;
+                            }
+                            else
+                                slot.status = STATUS_INFERENCE_FAILED;
+                            slot.state.store(SLOT_DONE, std::memory_order_release);
+                            futex_wake(slot.state); });
+                if (!submitted)
+                {
+                    // 还给客户端: 仍未被取走,客户端超时的话可以撤回后改用套接字
+                    slot.state.store(SLOT_REQUEST, std::memory_order_release);
+                    full = true;
+                    break;
+                }
+            }
+        }
+        if (r.doorbell.load(std::memory_order_acquire) == seen)
+            futex_wait(r.doorbell, seen);
+    }
+}
+
+// 客户端: 占用共享内存中的一个通道,同步地逐个发送请求
+// 不是线程安全的,每个线程用自己的客户端
+class ShmClient
+{
+public:
+    ShmClient() = default;
+    ~ShmClient() { detach(); }
+
+    // 映射服务端的共享内存并占用一个空闲通道,服务端没有运行或通道已满时返回false
+    bool attach(const char *name = SHM_NAME);
+    void detach();
+    bool attached() const { return channel_ != nullptr; }
+
+    enum Result
+    {
+        SHM_OK,
+        SHM_FAILED,      // 服务端返回了失败状态
+        SHM_TIMEOUT,     // 超过timeoutMs,请求已经在服务端计算,服务端仍会完成它,不要从别的途径重发
+        SHM_UNAVAILABLE, // 没有连上,没有空闲槽,服务端进程已经退出或者请求已撤回,可以改用套接字发送
+    };
+
+    // 同步预测一行,output为OUTPUT_FLOATS个float; 服务端进程已经退出时同时断开
+    Result predict(const float *input, float *output, int timeoutMs = 2000);
+    Result predict(const uint8_t *pixels, float *output, int timeoutMs = 2000);
+
+    ShmClient(const ShmClient &) = delete;
+    ShmClient &operator=(const ShmClient &) = delete;
+
+private:
+    Result run_slot(ShmSlot &slot, float *output, int timeoutMs);
+    ShmSlot *next_slot();
+
+    ShmRegion *region_ = nullptr;
+    ShmChannel *channel_ = nullptr;
+    size_t head_ = 0; // 下一个使用的槽
+};
+
+inline bool ShmClient::attach(const char *name)
+{
+    if (attached())
+        return true;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ShmRegion))
+    {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    region_ = static_cast<ShmRegion *>(p);
+    if (region_->magic != SHM_MAGIC || region_->version != SHM_LAYOUT_VERSION ||
+        (kill(region_->server, 0) == -1 && errno == ESRCH))
+    {
+        detach();
+        return false;
+    }
+
+    // 占用空闲通道; 占用者进程已经不存在的通道也可以回收
+    // 回收时只撤回服务端还没取走的请求,BUSY的槽还在计算,留给服务端完成
+    int32_t self = getpid();
+    for (ShmChannel &channel : region_->channels)
+    {
+        int32_t owner = channel.owner.load();
+        bool dead = owner != 0 && kill(owner, 0) == -1 && errno == ESRCH;
+        if ((owner == 0 || dead) && channel.owner.compare_exchange_strong(owner, self))
+        {
+            for (ShmSlot &slot : channel.slots)
+            {
+                uint32_t expected = SLOT_REQUEST;
+                slot.state.compare_exchange_strong(expected, SLOT_FREE);
+            }
+            channel_ = &channel;
+            head_ = 0;
+            return true;
+        }
+    }
+    detach();
+    return false;
+}
+
+inline void ShmClient::detach()
+{
+    if (channel_)
+        channel_->owner.store(0);
+    channel_ = nullptr;
+    if (region_)
+        munmap(region_, sizeof(ShmRegion));
+    region_ = nullptr;
+}
+
+inline ShmSlot *ShmClient::next_slot()
+{
+    // 请求是同步的,DONE的槽只能是之前超时放弃的请求,结果已经没有人要,可以直接使用
+    for (size_t i = 0; i < SHM_SLOTS; ++i)
+    {
+        ShmSlot &slot = channel_->slots[head_ % SHM_SLOTS];
+        ++head_;
+        uint32_t s = slot.state.load(std::memory_order_acquire);
+        if (s == SLOT_FREE || s == SLOT_DONE)
+            return &slot;
+    }
+    return nullptr; // 所有槽都还在服务端计算
+}
+
+inline ShmClient::Result ShmClient::run_slot(ShmSlot &slot, float *output, int timeoutMs)
+{
+    uint32_t generation = slot.generation.load(std::memory_order_relaxed) + 1;
+    slot.generation.store(generation, std::memory_order_relaxed);
+    slot.state.store(SLOT_REQUEST, std::memory_order_release);
+    region_->doorbell.fetch_add(1, std::memory_order_release);
+    futex_wake(region_->doorbell);
+
+    // 等结果: 先短暂自旋,再在槽的state上futex等待
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    uint32_t s;
+    for (int spin = 0; (s = slot.state.load(std::memory_order_acquire)) != SLOT_DONE; ++spin)
+    {
+        if (spin < 1000)
+            continue;
+        auto left = deadline - std::chrono::steady_clock::now();
+        if (left <= std::chrono::nanoseconds(0))
+        {
+            // 超时只说明服务端忙(负载高或正在重新加载模型): 还没被取走的请求撤回,
+            // 已经在计算的留给服务端完成,槽变成DONE后由next_slot重新使用; 服务端进程不在了才断开
+            uint32_t expected = SLOT_REQUEST;
+            if (slot.state.compare_exchange_strong(expected, SLOT_FREE, std::memory_order_acq_rel))
+                return SHM_UNAVAILABLE;
+            if (expected == SLOT_DONE) // 刚好算完
+                break;
+            if (kill(region_->server, 0) == -1 && errno == ESRCH)
+            {
+                detach();
+                return SHM_UNAVAILABLE;
+            }
+            return SHM_TIMEOUT;
+        }
+        struct timespec ts;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        futex_wait(slot.state, s, &ts);
+    }
+    bool ok = slot.answered == generation && slot.status == STATUS_OK;
+    if (ok)
+        memcpy(output, slot.output, OUTPUT_FLOATS * sizeof(float));
+    slot.state.store(SLOT_FREE, std::memory_order_release);
+    return ok ? SHM_OK : SHM_FAILED;
+}
+
+inline ShmClient::Result ShmClient::predict(const float *input, float *output, int timeoutMs)
+{
+    ShmSlot *slot = attached() ? next_slot() : nullptr;
+    if (!slot)
+        return SHM_UNAVAILABLE;
+    memcpy(slot->input, input, sizeof(slot->input));
+    slot->dtype = PAYLOAD_FP32;
+    return run_slot(*slot, output, timeoutMs);
+}
+
+inline ShmClient::Result ShmClient::predict(const uint8_t *pixels, float *output, int timeoutMs)
+{
+    ShmSlot *slot = attached() ? next_slot() : nullptr;
+    if (!slot)
+        return SHM_UNAVAILABLE;
+    memcpy(slot->pixels, pixels, sizeof(slot->pixels));
+    slot->dtype = PAYLOAD_U8;
+    return run_slot(*slot, output, timeoutMs);
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 进程级工作窃取线程池
+// 每个工作线程有自己的任务队列,从队尾取任务;自己的队列空了就从其他队列的队首窃取.
+// 调用parallel_for的线程也参与执行,所以在池内嵌套调用不会死锁;
+// 它只执行自己这次调用切出的块,不会被其他调用者的长任务拖住.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    // 全局唯一实例,第一次使用时创建
+    static ThreadPool &instance()
+    {
+        static ThreadPool pool(std::thread::hardware_concurrency());
+        return pool;
+    }
+
+    // 参与计算的线程数(包括调用线程)
+    size_t size() const { return workers_.size() + 1; }
+
+    // 把[begin, end)切成至少grain大小的块并行执行func(start, stop),返回时所有块都已完成
+    // 区间不足两块或者池中没有工作线程时直接在调用线程内执行
+    void parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)> &func)
+    {
+        if (end <= begin)
+            return;
+        size_t n = end - begin;
+        if (grain == 0)
+            grain = 1;
+        size_t chunks = std::min(size(), n / grain);
+        if (chunks <= 1)
+        {
+            func(begin, end);
+            return;
+        }
+
+        // 所有块共享的完成计数
+        struct Group
+        {
+            std::atomic<size_t> remaining;
+            std::mutex m;
+            std::condition_variable cv;
+        };
+        auto group = std::make_shared<Group>();
+        group->remaining = chunks;
+
+        size_t per = n / chunks, extra = n % chunks, start = begin;
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            size_t stop = start + per + (c < extra ? 1 : 0);
+            push(c % queues_.size(), group.get(), [group, &func, start, stop]()
+                 {
+                     func(start, stop);
+                     if (group->remaining.fetch_sub(1) == 1)
+                     {
+                         std::lock_guard<std::mutex> lock(group->m);
+                         group->cv.notify_all();
+                     } });
+            start = stop;
+        }
+
+        // 调用线程帮忙执行自己提交的块,直到全部完成; 剩下的块都被取走后等工作线程算完
+        Task task;
+        while (group->remaining.load() > 0)
+        {
+            if (pop(queues_.size(), task, group.get()))
+            {
+                task();
+                task = nullptr;
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lock(group->m);
+                group->cv.wait(lock, [&group]()
+                               { return group->remaining.load() == 0; });
+            }
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stop_ = true;
+        }
+        sleepCv_.notify_all();
+        for (auto &t : workers_)
+            if (t.joinable())
+                t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+private:
+    struct Item
+    {
+        Task task;
+        const void *owner; // 提交这个任务的parallel_for调用
+    };
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<Item> tasks;
+    };
+
+    explicit ThreadPool(unsigned threads)
+    {
+        size_t n = threads > 1 ? threads - 1 : 0; // 调用线程也算一个
+        for (size_t i = 0; i < std::max<size_t>(n, 1); ++i)
+            queues_.emplace_back(new Queue);
+        for (size_t i = 0; i < n; ++i)
+            workers_.emplace_back([this, i]()
+                                  { run(i); });
+    }
+
+    void push(size_t q, const void *owner, Task task)
+    {
+        // 先计数再放进队列: 任务放进去后马上就可能被窃取,取走时的减1不能跑到加1前面
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            ++pending_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues_[q]->m);
+            queues_[q]->tasks.push_back(Item{std::move(task), owner});
+        }
+        sleepCv_.notify_one();
+    }
+
+    // self为自己的队列下标,self越界表示外部线程,只做窃取
+    // owner不为空时只取这个调用者提交的任务
+    bool pop(size_t self, Task &task, const void *owner = nullptr)
+    {
+        if (self < queues_.size())
+        {
+            std::lock_guard<std::mutex> lock(queues_[self]->m);
+            if (!queues_[self]->tasks.empty())
+            {
+                task = std::move(queues_[self]->tasks.back().task);
+                queues_[self]->tasks.pop_back();
+                --pending_;
+                return true;
+            }
+        }
+        for (size_t i = 0; i < queues_.size(); ++i)
+        {
+            size_t victim = (self + 1 + i) % queues_.size();
+            std::lock_guard<std::mutex> lock(queues_[victim]->m);
+            std::deque<Item> &tasks = queues_[victim]->tasks;
+            auto it = owner ? std::find_if(tasks.begin(), tasks.end(), [owner](const Item &item)
+                                           { return item.owner == owner; })
+                            : tasks.begin();
+            if (it != tasks.end())
+            {
+                task = std::move(it->task);
+                tasks.erase(it);
+                --pending_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self)
+    {
+        Task task;
+        while (true)
+        {
+            if (pop(self, task))
+            {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            sleepCv_.wait(lock, [this]()
+                          { return stop_ || pending_.load() > 0; });
+            if (stop_)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex sleepMutex_;
+    std::condition_variable sleepCv_;
+    std::atomic<size_t> pending_{0}; // 尚未被取走的任务数
+    bool stop_ = false;
+};
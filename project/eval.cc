@@ -0,0 +1,386 @@
+#include "Quantized.h"
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+// 离线批量评估: 不打开窗口,把整个数据集送进解码 -> 预处理 -> 批量推理,报告准确率,混淆矩阵,吞吐量和各阶段耗时
+// 每次性能改动之后都可以用它检查准确率有没有下降
+// 用法: eval <模型目录> <图片目录 | IDX图像文件 IDX标签文件> [--int8 | --fp16 | --bf16] [--batch N] [--invert]
+//   图片目录: 递归查找图片,标签取所在目录名(0~9),否则取文件名的第一个字符,例如num/3.png或digits/3/a.png
+//   IDX文件: MNIST格式的train-images-idx3-ubyte和train-labels-idx1-ubyte
+//   --invert: 白底黑字和黑底白字互换,MNIST原始数据是黑底白字,而模型输入是白底黑字
+
+using Clock = std::chrono::steady_clock;
+
+inline double elapsed_us(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// 数据集: 按下标取样本,可以在多个线程中同时调用load
+class Dataset
+{
+public:
+    virtual ~Dataset() = default;
+    virtual size_t size() const = 0;
+    virtual int label(size_t i) const = 0;
+    // 解码第i个样本并预处理成784个float写入dst,分别累加解码和预处理的耗时; 解码失败返回false
+    virtual bool load(size_t i, float *dst, double &decodeUs, double &preprocessUs) const = 0;
+};
+
+// 图片目录
+class ImageDirDataset : public Dataset
+{
+public:
+    explicit ImageDirDataset(const string &dir);
+    size_t size() const { return files_.size(); }
+    int label(size_t i) const { return labels_[i]; }
+    bool load(size_t i, float *dst, double &decodeUs, double &preprocessUs) const;
+
+private:
+    std::vector<string> files_;
+    std::vector<int> labels_;
+};
+
+inline ImageDirDataset::ImageDirDataset(const string &dir)
+{
+    namespace fs = std::filesystem;
+    auto digit = [](const string &s)
+    { return !s.empty() && s[0] >= '0' && s[0] <= '9' ? s[0] - '0' : -1; };
+    for (const fs::directory_entry &e : fs::recursive_directory_iterator(dir))
+    {
+        if (!e.is_regular_file())
+            continue;
+        string ext = e.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext != ".png" && ext != ".jpg" && ext != ".jpeg" && ext != ".bmp")
+            continue;
+        string parent = e.path().parent_path().filename().string();
+        int label = parent.size() == 1 ? digit(parent) : -1;
+        if (label < 0)
+            label = digit(e.path().filename().string());
+        if (label < 0)
+            continue; // 无法确定标签
+        files_.push_back(e.path().string());
+        labels_.push_back(label);
+    }
+}
+
+inline bool ImageDirDataset::load(size_t i, float *dst, double &decodeUs, double &preprocessUs) const
+{
+    auto t0 = Clock::now();
+    cv::Mat image = cv::imread(files_[i], cv::IMREAD_COLOR);
+    decodeUs += elapsed_us(t0);
+    if (image.empty())
+        return false;
+    t0 = Clock::now();
+    preprocess_into(image, dst);
+    preprocessUs += elapsed_us(t0);
+    return true;
+}
+
+// MNIST的IDX文件: 整个文件读入内存,不需要解码,样本直接从原始字节预处理
+class IdxDataset : public Dataset
+{
+public:
+    IdxDataset(const string &imageFile, const string &labelFile);
+    size_t size() const { return labels_.size(); }
+    int label(size_t i) const { return labels_[i]; }
+    bool load(size_t i, float *dst, double &decodeUs, double &preprocessUs) const;
+
+private:
+    std::vector<uint8_t> pixels_; // count x rows x cols
+    std::vector<uint8_t> labels_;
+    size_t rows_ = 0, cols_ = 0;
+};
+
+// 读取整个文件,检查IDX头中的魔数并返回各维度(大端)
+inline std::vector<uint8_t> read_idx(const string &path, uint32_t magic, std::vector<uint32_t> &dims)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + path);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    auto be32 = [&](size_t off)
+    { return (uint32_t)data[off] << 24 | (uint32_t)data[off + 1] << 16 | (uint32_t)data[off + 2] << 8 | data[off + 3]; };
+    size_t ndim = magic & 0xFF;
+    if (data.size() < 4 + 4 * ndim || be32(0) != magic)
+        throw std::runtime_error(path + " is not an IDX file with magic " + std::to_string(magic));
+    size_t count = 1;
+    dims.clear();
+    for (size_t d = 0; d < ndim; ++d)
+    {
+        dims.push_back(be32(4 + 4 * d));
+        count *= dims.back();
+    }
+    size_t header = 4 + 4 * ndim;
+    if (data.size() < header + count)
+        throw std::runtime_error(path + " is truncated");
+    return std::vector<uint8_t>(data.begin() + header, data.begin() + header + count);
+}
+
+inline IdxDataset::IdxDataset(const string &imageFile, const string &labelFile)
+{
+    std::vector<uint32_t> dims;
+    pixels_ = read_idx(imageFile, 0x00000803, dims);
+    size_t count = dims[0];
+    rows_ = dims[1];
+    cols_ = dims[2];
+    labels_ = read_idx(labelFile, 0x00000801, dims);
+    if (labels_.size() != count)
+        throw std::runtime_error("Image and label files have different sample counts");
+}
+
+inline bool IdxDataset::load(size_t i, float *dst, double &decodeUs, double &preprocessUs) const
+{
+    (void)decodeUs;
+    auto t0 = Clock::now();
+    thread_local std::vector<float> scratch;
+    if (scratch.size() < cols_)
+        scratch.resize(cols_);
+    gray_area_resize(pixels_.data() + i * rows_ * cols_, rows_, cols_, cols_, 1, dst, 28, 28, 28, 1.0f / 255.0f,
+                     scratch.data());
+    preprocessUs += elapsed_us(t0);
+    return true;
+}
+
+// 一批样本: 解码和预处理由线程池并行完成,推理线程拿到的是整理好的输入矩阵
+struct Chunk
+{
+    size_t begin = 0, count = 0;
+    Matrix<float> input;
+    std::vector<char> ok;           // 每个样本是否解码成功
+    std::vector<double> decodeUs;   // 每个样本的解码耗时
+    std::vector<double> preprocessUs;
+
+    explicit Chunk(size_t batch) : input(batch, 784), ok(batch), decodeUs(batch), preprocessUs(batch) {}
+};
+
+void prepare(const Dataset &data, size_t begin, size_t batch, bool invert, Chunk &chunk)
+{
+    chunk.begin = begin;
+    chunk.count = std::min(batch, data.size() - begin);
+    ThreadPool::instance().parallel_for(0, chunk.count, 1, [&](size_t b0, size_t b1)
+                                        {
+                                            for (size_t i = b0; i < b1; ++i)
+                                            {
+                                                chunk.decodeUs[i] = chunk.preprocessUs[i] = 0;
+                                                float *row = chunk.input.row(i);
+                                                chunk.ok[i] = data.load(begin + i, row, chunk.decodeUs[i], chunk.preprocessUs[i]);
+                                                if (chunk.ok[i] && invert)
+                                                    for (size_t j = 0; j < 784; ++j)
+                                                        row[j] = 1.0f - row[j]; // 输入已归一化,(255 - p) / 255 = 1 - p / 255
+                                            } });
+}
+
+// 后台加载: 整个评估只用一个加载线程,两个Chunk轮流使用
+// 第i批准备在chunks[i % 2]里,推理线程release之后加载线程才会用它准备第i + 2批
+class Prefetcher
+{
+public:
+    Prefetcher(const Dataset &data, size_t batch, bool invert);
+    ~Prefetcher();
+
+    // 等到第i批准备好; 返回的Chunk在release(i)之前不会被改写
+    Chunk &acquire(size_t i);
+    void release(size_t i);
+
+    Prefetcher(const Prefetcher &) = delete;
+    Prefetcher &operator=(const Prefetcher &) = delete;
+
+private:
+    void run();
+
+    const Dataset &data_;
+    size_t batch_;
+    bool invert_;
+    Chunk chunks_[2];
+    bool ready_[2] = {false, false}; // chunks_[k]已经准备好,还没有被release
+    bool stop_ = false;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+Prefetcher::Prefetcher(const Dataset &data, size_t batch, bool invert)
+    : data_(data), batch_(batch), invert_(invert), chunks_{Chunk(batch), Chunk(batch)}
+{
+    thread_ = std::thread([this]()
+                          { run(); });
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+void Prefetcher::run()
+{
+    for (size_t begin = 0, k = 0; begin < data_.size(); begin += batch_, k ^= 1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cv_.wait(lock, [&]()
+                     { return stop_ || !ready_[k]; });
+            if (stop_)
+                return;
+        }
+        prepare(data_, begin, batch_, invert_, chunks_[k]);
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            ready_[k] = true;
+        }
+        cv_.notify_all();
+    }
+}
+
+Chunk &Prefetcher::acquire(size_t i)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    cv_.wait(lock, [&]()
+             { return ready_[i % 2]; });
+    return chunks_[i % 2];
+}
+
+void Prefetcher::release(size_t i)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        ready_[i % 2] = false;
+    }
+    cv_.notify_all();
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<string> paths;
+    bool useInt8 = false, invert = false;
+    WeightStorage storage = WeightStorage::Native;
+    size_t batch = 64;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--int8")
+            useInt8 = true;
+        else if (string(argv[i]) == "--fp16")
+            storage = WeightStorage::FP16;
+        else if (string(argv[i]) == "--bf16")
+            storage = WeightStorage::BF16;
+        else if (string(argv[i]) == "--invert")
+            invert = true;
+        else if (string(argv[i]) == "--batch" && i + 1 < argc)
+            batch = std::max<size_t>(1, std::stoul(argv[++i]));
+        else
+            paths.push_back(argv[i]);
+    }
+    if (paths.size() != 2 && paths.size() != 3)
+    {
+        printf("Usage: %s <model dir> <image dir | idx images idx labels> [--int8 | --fp16 | --bf16] [--batch N] [--invert]\n",
+               argv[0]);
+        return 1;
+    }
+
+    std::shared_ptr<const modelbase> m;
+    std::unique_ptr<Dataset> data;
+    try
+    {
+        m = useInt8 ? std::make_shared<const model_int8>(paths[0]) : load_model(paths[0], storage);
+        if (paths.size() == 3)
+            data = std::make_unique<IdxDataset>(paths[1], paths[2]);
+        else
+            data = std::make_unique<ImageDirDataset>(paths[1]);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    if (data->size() == 0)
+    {
+        printf("No labelled images found in %s\n", paths[1].c_str());
+        return 0;
+    }
+    printf("Evaluating %zu samples in batches of %zu on %zu threads\n", data->size(), batch, ThreadPool::instance().size());
+
+    // 两个批次轮流使用: 推理当前批次时,下一批已经由加载线程在线程池上解码和预处理
+    size_t classes = m->output_size();
+    std::unique_ptr<InferenceSessionBase> session = m->make_session(batch);
+    std::vector<size_t> confusion(classes * classes); // 行: 标签,列: 预测
+    std::vector<size_t> index;                        // 批次中每个有效样本在数据集中的下标
+    size_t total = 0, correct = 0, failed = 0;
+    double decodeUs = 0, preprocessUs = 0, inferenceUs = 0, waitUs = 0;
+
+    auto start = Clock::now();
+    Prefetcher loader(*data, batch, invert);
+    for (size_t begin = 0, i = 0; begin < data->size(); begin += batch, ++i)
+    {
+        auto t0 = Clock::now();
+        Chunk &cur = loader.acquire(i);
+        waitUs += elapsed_us(t0);
+
+        // 解码失败的样本不参与推理
+        size_t n = 0;
+        index.clear();
+        for (size_t i = 0; i < cur.count; ++i)
+        {
+            decodeUs += cur.decodeUs[i];
+            preprocessUs += cur.preprocessUs[i];
+            if (!cur.ok[i])
+            {
+                ++failed;
+                continue;
+            }
+            if (n != i)
+                std::memcpy(cur.input.row(n), cur.input.row(i), 784 * sizeof(float));
+            index.push_back(cur.begin + i);
+            ++n;
+        }
+
+        t0 = Clock::now();
+        const Matrix<float> *out = n ? &session->forward(Matrix<float>::view(cur.input.data(), n, 784, cur.input.stride())) : nullptr;
+        inferenceUs += elapsed_us(t0);
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float *p = out->row(i);
+            size_t best = std::max_element(p, p + classes) - p;
+            size_t label = data->label(index[i]);
+            if (label < classes)
+                ++confusion[label * classes + best];
+            correct += best == label;
+            ++total;
+        }
+        loader.release(i);
+    }
+    double wallUs = elapsed_us(start);
+
+    printf("\nConfusion matrix (rows: label, columns: prediction)\n      ");
+    for (size_t j = 0; j < classes; ++j)
+        printf("%6zu", j);
+    printf("\n");
+    for (size_t i = 0; i < classes; ++i)
+    {
+        printf("%6zu", i);
+        for (size_t j = 0; j < classes; ++j)
+            printf("%6zu", confusion[i * classes + j]);
+        printf("\n");
+    }
+
+    printf("\nAccuracy: %zu/%zu (%.2f%%)", correct, total, total ? 100.0 * correct / total : 0.0);
+    if (failed)
+        printf(", %zu images could not be decoded", failed);
+    printf("\nThroughput: %.1f images/s (%.1f ms total)\n", total / (wallUs / 1e6), wallUs / 1000);
+    // 解码和预处理是各线程耗时之和,与推理重叠; 等待是推理线程等下一批准备好的时间
+    size_t samples = total + failed;
+    printf("Per image: decode %.1f us, preprocess %.1f us (summed over threads), inference %.1f us\n",
+           decodeUs / samples, preprocessUs / samples, inferenceUs / std::max<size_t>(1, total));
+    printf("Inference thread waited %.1f ms for input\n", waitUs / 1000);
+    return 0;
+}
@@ -1,18 +1,211 @@
 #include "Matrix.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 using namespace cv;
 using namespace std;
 
+#define MODEL_PATH "/home/wmx/桌面/project/GKDproject/project/mnist-fc"
+
+// 后台推理线程: 画布每次变化只把快照交给它,不在GUI线程上等待推理
+// 只保留最新的一份快照,推理期间到来的多次更新合并成一次,过时的中间帧直接丢弃
+// 快照只拷贝变化的矩形区域,推理线程也只重新计算被这些区域影响到的28x28输入格子
+// 结果由GUI线程取走并显示(HighGUI只能在GUI线程调用)
+class AsyncPredictor
+{
+public:
+    explicit AsyncPredictor(std::shared_ptr<const modelbase> model);
+    ~AsyncPredictor();
+
+    // 把画布中dirty区域拷贝到快照缓冲区后立即返回
+    void submit(const Mat &canvas, const Rect &dirty);
+    // 有新的结果时写入probs并返回true
+    bool poll(vector<float> &probs);
+
+    AsyncPredictor(const AsyncPredictor &) = delete;
+    AsyncPredictor &operator=(const AsyncPredictor &) = delete;
+
+private:
+    void run();
+
+    // 服务端不可用时在本地计算,每隔这么久再试一次服务端
+    static constexpr std::chrono::seconds REMOTE_RETRY{5};
+
+    std::shared_ptr<const modelbase> model_; // 只加载一次,服务端不可用时在本地计算
+    std::mutex m_;
+    std::condition_variable cv_;
+    Mat pending_;               // 最新的画布快照
+    Rect dirty_;                // pending_中推理线程还没有取走的变化区域
+    vector<float> result_;      // 最新的预测结果
+    bool hasResult_ = false;    // result_还没有被GUI线程取走
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+AsyncPredictor::AsyncPredictor(std::shared_ptr<const modelbase> model) : model_(std::move(model))
+{
+    thread_ = std::thread([this]()
+                          { run(); });
+}
+
+AsyncPredictor::~AsyncPredictor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+// 拷贝src中r区域的像素到dst的相同位置,两者尺寸和类型相同
+static void copyRegion(const Mat &src, Mat &dst, const Rect &r)
+{
+    size_t offset = (size_t)r.x * src.elemSize(), bytes = (size_t)r.width * src.elemSize();
+    for (int y = r.y; y < r.y + r.height; ++y)
+        memcpy(dst.ptr<uchar>(y) + offset, src.ptr<uchar>(y) + offset, bytes);
+}
+
+void AsyncPredictor::submit(const Mat &canvas, const Rect &dirty)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        Rect r = dirty & Rect(0, 0, canvas.cols, canvas.rows);
+        if (pending_.size() != canvas.size() || pending_.type() != canvas.type())
+        {
+            pending_ = canvas.clone(); // 第一次或画布尺寸变化: 整幅拷贝
+            r = Rect(0, 0, canvas.cols, canvas.rows);
+        }
+        else
+            copyRegion(canvas, pending_, r);
+        if (r.empty())
+            return;
+        dirty_ = dirty_.empty() ? r : (dirty_ | r);
+    }
+    cv_.notify_one();
+}
+
+bool AsyncPredictor::poll(vector<float> &probs)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (!hasResult_)
+        return false;
+    probs.swap(result_);
+    hasResult_ = false;
+    return true;
+}
+
+void AsyncPredictor::run()
+{
+    Mat snapshot;                 // 推理线程自己的画布副本,只更新变化的区域
+    float cells[INPUT_FLOATS];    // 28x28灰度(0~255),只重新计算变化区域覆盖的格子
+    uint8_t pixels[INPUT_FLOATS]{}; // 取整后的像素,与cells一样只更新变化的格子
+    vector<float> probs(OUTPUT_FLOATS);
+    float input[INPUT_FLOATS];
+    uint32_t indices[INPUT_FLOATS]; // 本次变化的输入格子,本地计算时只把它们交给会话做增量推理
+    float values[INPUT_FLOATS];
+    std::unique_ptr<InferenceSessionBase> session; // 第一次在本地计算时创建
+    bool primed = false;                           // 会话已经有当前的完整输入,之后可以增量更新
+    std::chrono::steady_clock::time_point retryRemote; // 在本地计算期间,到这个时间再试一次服务端
+    Rect dirty;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cv_.wait(lock, [this]()
+                     { return stop_ || !dirty_.empty(); });
+            if (stop_)
+                return;
+            if (snapshot.size() != pending_.size() || snapshot.type() != pending_.type())
+            {
+                snapshot = pending_.clone();
+                dirty = Rect(0, 0, snapshot.cols, snapshot.rows);
+            }
+            else
+            {
+                dirty = dirty_;
+                copyRegion(pending_, snapshot, dirty);
+            }
+            dirty_ = Rect();
+        }
+
+        // 只有被dirty覆盖的格子需要重新计算和取整
+        Rect changed = preprocess_region(snapshot, dirty, cells, 1.0f);
+        size_t k = 0;
+        for (int y = changed.y; y < changed.y + changed.height; ++y)
+            for (int x = changed.x; x < changed.x + changed.width; ++x)
+            {
+                uint8_t p = (uint8_t)std::min(255.0f, cells[y * 28 + x] + 0.5f); // 四舍五入
+                if (primed && p == pixels[y * 28 + x])
+                    continue;
+                pixels[y * 28 + x] = p;
+                indices[k] = y * 28 + x;
+                values[k++] = p / 255.0f;
+            }
+        // 服务端发送完整的像素; indices/values只在本地增量推理时使用
+        bool local = session && std::chrono::steady_clock::now() < retryRemote;
+        if (!local)
+        {
+            try
+            {
+                remote_predict(pixels, probs.data());
+                if (session && primed)
+                    fprintf(stderr, "Server is back, predicting remotely\n");
+                primed = false; // 本地会话缓存的输入已经过时,下次在本地计算时整体重置
+            }
+            catch (const std::exception &e)
+            {
+                if (!session)
+                    session = model_->make_session(1);
+                if (!primed)
+                    fprintf(stderr, "%s, predicting locally\n", e.what());
+                retryRemote = std::chrono::steady_clock::now() + REMOTE_RETRY;
+                local = true;
+            }
+        }
+        if (local)
+        {
+            // 第一层只按变化的格子增量更新
+            const Matrix<float> *out;
+            if (primed)
+                out = &session->update_input(indices, values, k);
+            else
+            {
+                u8_to_float(pixels, input, INPUT_FLOATS, 1.0f / 255.0f);
+                out = &session->reset_input(input, INPUT_FLOATS);
+                primed = true;
+            }
+            std::copy(out->row(0), out->row(0) + out->cols(), probs.begin());
+        }
+
+        std::lock_guard<std::mutex> lock(m_);
+        result_.assign(probs.begin(), probs.end());
+        hasResult_ = true;
+    }
+}
+
 // 全局变量用于存储绘图状态和图像
-Mat gCanvas;          // 画布矩阵
-bool Drawing = false; // 标记是否正在绘制
-Point PreviousPoint;  // 记录上一个鼠标位置，用于画连续线
+Mat gCanvas;                         // 画布矩阵
+bool Drawing = false;                // 标记是否正在绘制
+Point PreviousPoint;                 // 记录上一个鼠标位置，用于画连续线
+AsyncPredictor *gPredictor = nullptr; // 画布变化时把快照交给后台推理
+
+// 粗细为thickness的线段(含抗锯齿边缘)可能改动的像素范围
+static Rect strokeRect(Point a, Point b, int thickness)
+{
+    int pad = thickness / 2 + 2;
+    int x0 = std::min(a.x, b.x) - pad, y0 = std::min(a.y, b.y) - pad;
+    int x1 = std::max(a.x, b.x) + pad + 1, y1 = std::max(a.y, b.y) + pad + 1;
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
 
 // 鼠标回调函数
 void onMouse(int event, int x, int y, int flags, void *userdata)
 {
     // 将userdata转换为Mat指针，获取我们的画布
     Mat *pCanvas = (Mat *)(userdata);
+    Rect dirty; // 画布上变化的区域,为空时不需要重新预测
 
     switch (event)
     {
@@ -30,6 +223,7 @@ void onMouse(int event, int x, int y, int flags, void *userdata)
             // 在起点和终点之间画一条线（一次性线段）
             line(*pCanvas, PreviousPoint, Point(x, y), Scalar(0, 0, 0), 10, LINE_AA);
             imshow("drawing", *pCanvas);
+            dirty = strokeRect(PreviousPoint, Point(x, y), 10);
         }
         break;
 
@@ -40,6 +234,7 @@ void onMouse(int event, int x, int y, int flags, void *userdata)
             Point currentPoint(x, y);
             // 在上一个点和当前点之间画线，实现笔触效果
             line(*pCanvas, PreviousPoint, currentPoint, Scalar(0, 0, 0), 10, LINE_AA);
+            dirty = strokeRect(PreviousPoint, currentPoint, 10);
             PreviousPoint = currentPoint; // 更新上一个点
             imshow("drawing", *pCanvas);  // 实时更新显示
         }
@@ -49,13 +244,15 @@ void onMouse(int event, int x, int y, int flags, void *userdata)
     case EVENT_RBUTTONDOWN:
         *pCanvas = Scalar(255, 255, 255); // 用白色填充，清除画布
         imshow("drawing", *pCanvas);
+        dirty = Rect(0, 0, pCanvas->cols, pCanvas->rows);
         break;
     }
-    const modelbase &mb = model<float>("/home/wmx/桌面/project/GKDproject/project/mnist-fc");
-    mb.predict(gCanvas);
+    if (!dirty.empty() && gPredictor)
+        gPredictor->submit(*pCanvas, dirty);
 }
 
-int main()
+// 用法: main [模型目录]
+int main(int argc, char *argv[])
 {
     //    const modelbase& mb1= model<double>("/home/wmx/桌面/project/GKDproject/project/mnist-fc-plus");
     //    const modelbase& mb2= model<float>("/home/wmx/桌面/project/GKDproject/project/mnist-fc");
@@ -68,6 +265,20 @@ int main()
     const int height = 100;
     gCanvas = Mat(height, width, CV_8UC3, Scalar(255, 255, 255));
 
+    // 模型只在启动时加载一次
+    std::shared_ptr<const modelbase> mb;
+    try
+    {
+        mb = load_model(argc > 1 ? argv[1] : MODEL_PATH);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "Failed to load model: %s\nUsage: %s [model directory]\n", e.what(), argv[0]);
+        return 1;
+    }
+    AsyncPredictor predictor(mb);
+    gPredictor = &predictor;
+
     // 创建窗口
     namedWindow("drawing", WINDOW_AUTOSIZE);
 
@@ -77,10 +288,13 @@ int main()
     // 显示初始画布
     imshow("drawing", gCanvas);
 
-    // 主循环：处理键盘输入
+    // 主循环：处理键盘输入,并显示后台推理的最新结果
+    vector<float> probs;
     while (true)
     {
-        int key = waitKey(0); // 等待按键
+        int key = waitKey(15); // 等待按键,超时后检查有没有新的预测结果
+        if (predictor.poll(probs))
+            mb->drawBarChart(probs, "predict", 800, 600);
 
         switch (key)
         {
@@ -91,6 +305,7 @@ int main()
 
         case 27: // ESC键退出
             cout << "Exiting..." << endl;
+            gPredictor = nullptr;
             return 0;
         }
     }
@@ -0,0 +1,79 @@
+#include "Quantized.h"
+#include <chrono>
+
+// 离线量化工具: 为模型目录生成int8权重以及fp16/bf16权重,并在num/*.png上与fp32对比准确率
+// 用法: quantize <模型目录> [图片目录, 默认为<模型目录>/../num]
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <model dir> [image dir]\n", argv[0]);
+        return 1;
+    }
+    string dir = argv[1];
+    string imageDir = argc > 2 ? argv[2] : dir + "/../num";
+
+    float maxErr = quantize_model(dir);
+    printf("Quantized %s, max weight error %g\n", dir.c_str(), maxErr);
+    save_half_weights(dir, WeightStorage::FP16);
+    save_half_weights(dir, WeightStorage::BF16);
+    printf("Wrote fp16 and bf16 weights\n");
+
+    // 第一个是基准
+    const char *names[] = {"fp32", "fp16", "bf16", "int8"};
+    std::shared_ptr<const modelbase> models[] = {load_model(dir), load_model(dir, WeightStorage::FP16),
+                                                 load_model(dir, WeightStorage::BF16), std::make_shared<const model_int8>(dir)};
+    constexpr size_t count = sizeof(models) / sizeof(models[0]);
+    std::unique_ptr<InferenceSessionBase> sessions[count];
+    for (size_t m = 0; m < count; ++m)
+        sessions[m] = models[m]->make_session(1);
+
+    // 图片文件名就是标签: 0.png ~ 9.png
+    int total = 0, correct[count] = {};
+    double time[count] = {}, maxDiff[count] = {};
+    printf("image  label");
+    for (const char *name : names)
+        printf("  %s(prob)     ", name);
+    printf("\n");
+    for (int label = 0; label < 10; ++label)
+    {
+        string file = imageDir + "/" + std::to_string(label) + ".png";
+        cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+        if (image.empty())
+            continue;
+        Matrix<float> input = preprocess(image);
+
+        // 基准输出要和其他模型逐项比较,先拷贝出来
+        std::vector<float> baseline;
+        printf("%-6s %-6d", (std::to_string(label) + ".png").c_str(), label);
+        for (size_t m = 0; m < count; ++m)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            const Matrix<float> &out = sessions[m]->forward(input);
+            time[m] += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+            if (m == 0)
+                baseline.assign(out.row(0), out.row(0) + out.cols());
+            size_t best = 0;
+            for (size_t j = 0; j < out.cols(); ++j)
+            {
+                if (out(0, j) > out(0, best))
+                    best = j;
+                maxDiff[m] = std::max(maxDiff[m], (double)std::abs(out(0, j) - baseline[j]));
+            }
+            printf("  %zu (%.4f)     ", best, out(0, best));
+            correct[m] += best == (size_t)label;
+        }
+        printf("\n");
+        ++total;
+    }
+    if (total == 0)
+    {
+        printf("No images found in %s\n", imageDir.c_str());
+        return 0;
+    }
+    for (size_t m = 0; m < count; ++m)
+        printf("%s: accuracy %d/%d, max probability difference %.4f, average latency %.1f us\n", names[m], correct[m], total,
+               maxDiff[m], time[m] / total);
+    return 0;
+}
@@ -1,11 +1,257 @@
-#include "Matrix.h"
+#include "Quantized.h"
+#include "Batcher.h"
+#include "Reactor.h"
+#include "ShmTransport.h"
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <csignal>
+#include <cerrno>
+#include <grp.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
 
-int main()
+#define MODEL_PATH "/home/wmx/桌面/project/GKDproject/project/mnist-fc"
+
+// 当前使用的模型: 启动时加载一次,之后只读,各线程通过shared_ptr共享
+// 计算类型由meta.json决定; 重新加载时整体替换指针,正在使用旧模型的请求不受影响
+std::atomic<std::shared_ptr<const modelbase>> gModel;
+bool gUseInt8 = false;                          // 使用quantize生成的int8权重
+WeightStorage gStorage = WeightStorage::Native; // --fp16/--bf16: 权重以16位存储,按fp32计算
+// 加载失败时保留原来的模型,返回false
+// 协议和批处理队列的行宽是固定的INPUT_FLOATS/OUTPUT_FLOATS,输入输出维度不同的模型不能换上去
+bool loadModel(const string &path)
 {
-    int serverSocket, clientSocket;            // 服务端和客户端套接字(文件描述符)
-    struct sockaddr_in serverAddr, clientAddr; // 服务器和客户端地址结构
-    socklen_t clientAddrLen;                   // 客户端地址长度
-    float buffer[BUFFER_SIZE];
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const modelbase> m;
+    try
+    {
+        if (gUseInt8)
+            m = std::make_shared<const model_int8>(path);
+        else
+            m = load_model(path, gStorage);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "Failed to load model %s: %s\n", path.c_str(), e.what());
+        return false;
+    }
+    if (m->input_size() != INPUT_FLOATS || m->output_size() != OUTPUT_FLOATS)
+    {
+        fprintf(stderr, "Failed to load model %s: expected %dx%d, got %zux%zu\n", path.c_str(),
+                INPUT_FLOATS, OUTPUT_FLOATS, m->input_size(), m->output_size());
+        return false;
+    }
+    gModel.store(std::move(m));
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    printf("Loaded model %s in %lld ms.\n", path.c_str(), (long long)ms);
+    return true;
+}
+
+// 一个多行请求拆成单行交给推理线程,最后一行算完时把整个请求的结果作为一个响应发回
+struct PendingRequest
+{
+    uint64_t conn;
+    ResponseHeader header;
+    std::vector<float> outputs; // batch x OUTPUT_FLOATS
+    std::atomic<uint32_t> remaining;
+    std::atomic<bool> failed{false};
+
+    PendingRequest(uint64_t conn, uint32_t id, uint32_t batch)
+        : conn(conn), header{PROTOCOL_MAGIC, PROTOCOL_VERSION, STATUS_OK, id, batch, 0},
+          outputs((size_t)batch * OUTPUT_FLOATS), remaining(batch) {}
+};
+
+// 推理队列满时一个多行请求可能只提交了一部分行,记下剩下的从哪一行开始,连接恢复读取后接着提交
+// 只在事件循环线程访问
+struct PartialRequest
+{
+    std::shared_ptr<PendingRequest> pending;
+    uint32_t nextRow;
+};
+std::unordered_map<uint64_t, PartialRequest> gPartial;
+
+// 发送只有头没有数据的响应(出错时)
+void sendStatus(Reactor &reactor, uint64_t conn, uint32_t id, uint16_t status)
+{
+    ResponseHeader header{PROTOCOL_MAGIC, PROTOCOL_VERSION, status, id, 0, 0};
+    reactor.reply(conn, &header, sizeof(header));
+}
+
+// 解析连接缓冲区里所有完整的帧,返回处理掉的字节数,不完整的帧留到下次
+// 魔数不对或长度超限时无法确定帧边界,返回len + 1让事件循环关闭连接
+// 推理队列满时不阻塞事件循环: 暂停读取这个连接,没提交完的帧留在缓冲区,有空位后从断开的那一行继续
+size_t handleData(Reactor &reactor, Batcher &batcher, uint64_t conn, const char *data, size_t len)
+{
+    size_t used = 0;
+    while (len - used >= sizeof(RequestHeader))
+    {
+        RequestHeader header;
+        memcpy(&header, data + used, sizeof(header));
+        if (header.magic != PROTOCOL_MAGIC || header.length > PROTOCOL_MAX_PAYLOAD)
+            return len + 1;
+        if (len - used - sizeof(header) < header.length)
+            break; // 帧还没收完
+        const char *payload = data + used + sizeof(header);
+        size_t frame = sizeof(header) + header.length;
+
+        size_t elem = payload_element_size(header.dtype);
+        if (header.version != PROTOCOL_VERSION || header.model != 0 || elem == 0 || header.batch == 0 ||
+            header.length != (size_t)header.batch * INPUT_FLOATS * elem)
+        {
+            reactor.expect_reply(conn);
+            sendStatus(reactor, conn, header.id, STATUS_BAD_REQUEST);
+            used += frame;
+            continue;
+        }
+
+        std::shared_ptr<PendingRequest> pending;
+        uint32_t first = 0;
+        auto partial = gPartial.find(conn);
+        if (partial != gPartial.end()) // 上次提交到一半的帧
+        {
+            pending = std::move(partial->second.pending);
+            first = partial->second.nextRow;
+            gPartial.erase(partial);
+        }
+        else
+        {
+            pending = std::make_shared<PendingRequest>(conn, header.id, header.batch);
+            reactor.expect_reply(conn);
+        }
+        for (uint32_t r = first; r < header.batch; ++r)
+        {
+            const char *row = payload + (size_t)r * INPUT_FLOATS * elem;
+            auto done = [&reactor, pending, r](const float *output, size_t n)
+            {
+                if (output && n == OUTPUT_FLOATS)
+                    memcpy(pending->outputs.data() + (size_t)r * OUTPUT_FLOATS, output, n * sizeof(float));
+                else
+                    pending->failed = true;
+                if (pending->remaining.fetch_sub(1) != 1)
+                    return;
+                // 最后一行: 整个请求完成
+                if (pending->failed)
+                {
+                    sendStatus(reactor, pending->conn, pending->header.id, STATUS_INFERENCE_FAILED);
+                    return;
+                }
+                pending->header.length = pending->outputs.size() * sizeof(float);
+                std::vector<char> response(sizeof(ResponseHeader) + pending->header.length);
+                memcpy(response.data(), &pending->header, sizeof(ResponseHeader));
+                memcpy(response.data() + sizeof(ResponseHeader), pending->outputs.data(), pending->header.length);
+                reactor.reply(pending->conn, response.data(), response.size());
+            };
+            bool submitted;
+            if (header.dtype == PAYLOAD_U8)
+            {
+                // 像素在装入批次时直接归一化
+                submitted = batcher.try_submit(reinterpret_cast<const uint8_t *>(row), INPUT_FLOATS, done);
+            }
+            else
+            {
+                // 请求数据可能没有按float对齐,先拷贝出来
+                float input[INPUT_FLOATS];
+                memcpy(input, row, sizeof(input));
+                submitted = batcher.try_submit(input, INPUT_FLOATS, done);
+            }
+            if (!submitted)
+            {
+                gPartial[conn] = PartialRequest{std::move(pending), r};
+                reactor.pause(conn);
+                return used;
+            }
+        }
+        used += frame;
+    }
+    return used;
+}
+
+// 用法: server [模型目录] [--int8 | --fp16 | --bf16] [--max-batch N] [--max-wait-us N] [--workers N] [--group NAME]
+// 本机的AF_UNIX套接字和共享内存默认只有运行服务端的用户能访问,--group把它们开放给这个组的成员
+// 运行中发送SIGHUP(kill -HUP <pid>)可重新加载模型
+int main(int argc, char *argv[])
+{
+    string modelPath = MODEL_PATH;
+    size_t maxBatch = 32; // 一个批次最多的请求数
+    long maxWaitUs = 200; // 负载高时批次中第一个请求最多等待的时间,单独到达的请求不等待
+    size_t workers = 0;   // 推理线程数,0表示每个CPU一个
+    gid_t group = (gid_t)-1; // 本机传输开放给的组,-1表示只有自己的用户
+    for (int i = 1; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--int8")
+            gUseInt8 = true;
+        else if (string(argv[i]) == "--fp16")
+            gStorage = WeightStorage::FP16;
+        else if (string(argv[i]) == "--bf16")
+            gStorage = WeightStorage::BF16;
+        else if (string(argv[i]) == "--max-batch" && i + 1 < argc)
+            maxBatch = std::stoul(argv[++i]);
+        else if (string(argv[i]) == "--max-wait-us" && i + 1 < argc)
+            maxWaitUs = std::stol(argv[++i]);
+        else if (string(argv[i]) == "--workers" && i + 1 < argc)
+            workers = std::stoul(argv[++i]);
+        else if (string(argv[i]) == "--group" && i + 1 < argc)
+        {
+            struct group *g = getgrnam(argv[++i]);
+            if (!g)
+            {
+                fprintf(stderr, "Unknown group %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            group = g->gr_gid;
+        }
+        else
+            modelPath = argv[i];
+    }
+    if (!loadModel(modelPath))
+        exit(EXIT_FAILURE);
+
+    // SIGHUP在所有线程中屏蔽,改由事件循环通过signalfd接收,在事件循环线程里重新加载
+    // 必须在创建任何线程之前设置,新线程会继承这个信号掩码
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, nullptr);
+    int hupFd = signalfd(-1, &hup, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (hupFd == -1)
+    {
+        perror("Failed to create signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // 推理线程每个批次开始时取一次当前模型,所以重新加载后下一批就用上新模型
+    // 事件循环只负责收发和解析,解析出的请求放进批处理队列,由各推理线程并行计算
+    Batcher batcher([]()
+                    { return gModel.load(); },
+                    maxBatch, std::chrono::microseconds(maxWaitUs), workers);
+    printf("%zu inference workers, max batch %zu\n", batcher.workers(), batcher.max_batch());
+
+    // 请求帧按行拆开交给推理线程,结果由推理线程通过reply交回事件循环
+    // 同一个连接上可以连续发来多个请求,逐个解析,不必等前一个的响应
+    Reactor reactor([&](uint64_t conn, const char *data, size_t len)
+                    { return handleData(reactor, batcher, conn, data, len); });
+    reactor.on_close([](uint64_t conn)
+                     { gPartial.erase(conn); });
+    // 推理队列有空位时,事件循环和共享内存扫描线程都可能有等着提交的请求
+    std::atomic<ShmServer *> shmServer{nullptr};
+    batcher.set_on_free([&]()
+                        {
+                            reactor.resume_paused();
+                            if (ShmServer *s = shmServer.load())
+                                s->notify(); });
+    reactor.watch(hupFd, [&]()
+                  {
+                      struct signalfd_siginfo info;
+                      bool reload = false;
+                      while (read(hupFd, &info, sizeof(info)) == sizeof(info))
+                          reload = true;
+                      if (reload)
+                          loadModel(modelPath); });
+
+    int serverSocket;              // 服务端套接字(文件描述符)
+    struct sockaddr_in serverAddr; // 服务器地址结构
 
     // 创建服务端套接字
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
@@ -28,70 +274,69 @@ int main()
         exit(EXIT_FAILURE);
     }
 
-    // 监听连接请求
-    if (listen(serverSocket, 5) == -1)
+    // 监听连接请求,并发请求多时积压队列要足够长
+    if (listen(serverSocket, SOMAXCONN) == -1)
     {
         perror("Failed to listen");
         exit(EXIT_FAILURE);
     }
 
-    // 服务器主循环
-    while (true)
+    // 同一台机器上的客户端可以连接AF_UNIX套接字,协议与TCP完全相同
+    // 连接上的请求和响应不经过任何认证,所以套接字文件只对自己的用户(和--group)开放
+    mode_t localMode = group == (gid_t)-1 ? 0600 : 0660;
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un unixAddr;
+    memset(&unixAddr, 0, sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    strncpy(unixAddr.sun_path, SERVER_UNIX_PATH, sizeof(unixAddr.sun_path) - 1);
+    unlink(SERVER_UNIX_PATH); // 上次运行留下的套接字文件
+    mode_t oldMask = umask(0177); // bind创建的文件从一开始就只有自己能访问,之后再按需开放
+    bool bound = unixSocket != -1 && bind(unixSocket, (struct sockaddr *)&unixAddr, sizeof(unixAddr)) == 0;
+    umask(oldMask);
+    if (!bound || (group != (gid_t)-1 && chown(SERVER_UNIX_PATH, (uid_t)-1, group) == -1) ||
+        chmod(SERVER_UNIX_PATH, localMode) == -1 || listen(unixSocket, SOMAXCONN) == -1)
     {
-        // 接受客户端连接
-        clientAddrLen = sizeof(clientAddr);
-        clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
-        if (clientSocket == -1)
-        {
-            perror("Failed to accept client connection");
-            exit(EXIT_FAILURE);
-        }
-
-        // 接收数据
-        memset(buffer, 0, BUFFER_SIZE * sizeof(float));                                // 清空缓冲区
-        int receivedSize = recv(clientSocket, buffer, BUFFER_SIZE * sizeof(float), 0); // 接收数据
-        if (receivedSize == -1)
-        {
-            perror("Failed to receive data");
-            exit(EXIT_FAILURE);
-        }
-        else // 成功接收数据
-        {
-            int numFloats = receivedSize / sizeof(float); // 计算接收到的浮点数数量
-
-            if (numFloats == 784) // 确认接收到的是784个浮点数
-            {
-                printf("Received %d floats from client.\n", numFloats);
-                // 处理数据
-                Matrix<float> input(1, 784);
-                for (int i = 0; i < 784; ++i)
-                {
-                    input(0, i) = buffer[i];
-                }
-                Matrix<float> output = model<float>("/home/wmx/桌面/project/GKDproject/project/mnist-fc")._predict(input); // 预测
+        perror("Failed to listen on unix socket");
+        if (unixSocket != -1)
+            close(unixSocket);
+        if (bound)
+            unlink(SERVER_UNIX_PATH);
+        unixSocket = -1;
+    }
 
-                // 发送响应给客户端
-                memset(buffer, 0, BUFFER_SIZE * sizeof(float)); // 清空缓冲区
-                for (int i = 0; i < 10; ++i)
-                {
-                    buffer[i] = output(0, i);
-                }
-                if (send(clientSocket, buffer, 10 * sizeof(float), 0) == -1)
-                {
-                    perror("Failed to send response");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else
-            {
-                // printf("Error: Expected 784 floats, but received %d floats.\n", numFloats);
-            }
-        }
+    // 共享内存传输: 请求从共享内存槽直接装入批次,不经过事件循环; 创建失败时只用套接字
+    std::unique_ptr<ShmServer> shm;
+    try
+    {
+        shm = std::make_unique<ShmServer>(SHM_NAME, [&](const ShmSlot &slot, Batcher::Callback done)
+                                          {
+                                              if (slot.dtype == PAYLOAD_U8)
+                                                  return batcher.try_submit(slot.pixels, INPUT_FLOATS, std::move(done));
+                                              return batcher.try_submit(slot.input, INPUT_FLOATS, std::move(done)); },
+                                          localMode, group);
+        shmServer.store(shm.get());
+        shm->notify(); // 构造期间提交失败的请求可能错过了onFree
     }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+    }
+
+    // 服务器主循环: 所有连接的收发都在事件循环里完成,推理在推理线程
+    reactor.listen_on(serverSocket);
+    if (unixSocket != -1)
+        reactor.listen_on(unixSocket);
+    reactor.run();
+    shmServer.store(nullptr); // 推理线程之后不再唤醒即将析构的扫描线程
 
     // 关闭套接字
-    close(clientSocket);
     close(serverSocket);
+    if (unixSocket != -1)
+    {
+        close(unixSocket);
+        unlink(SERVER_UNIX_PATH);
+    }
+    close(hupFd);
 
     return 0;
 }